@@ -1,3 +1,5 @@
+#define _GNU_SOURCE // getline(), clock_gettime(), ...
+#define _FILE_OFFSET_BITS 64 // recordings larger than 2 GB on 32 bit systems
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -5,35 +7,176 @@
 #include <unistd.h>
 #include <math.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <glob.h>
+#include <sched.h>
+#include <errno.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <signal.h>
+#include <pthread.h>
+#include <complex.h>
+#ifdef _OPENMP
+  #include <omp.h>
+#endif
+#ifdef __linux__
+  #include <linux/perf_event.h>
+  #include <sys/syscall.h>
+  #include <sys/ioctl.h>
+#endif
+#include "img_proc.h"
 
 /////////////////////////////////////////////////////////////////////////////// 
 // settings and notes
 /////////////////////////////////////////////////////////////////////////////// 
 
 // gcc commandline: gcc -std=c99 -pg -fno-inline -mfpu=neon -o img_proc img_proc.c 
+// add -fopenmp to run the parallel loops on all cores, -pthread for MULTI_STREAM
+// -DIMG_PROC_LIBRARY -c builds the processing without main() for other programs (see img_proc.h)
 
 // enable the define "FILE_IO" for file I/O,
 // otherwise use the following command line for "live" camera video processing (it requires package mplayer : sudo apt-get install mplayer2)
 // due to performance issues image size is reduced to 320x240
 // command line: raspivid -n -t 500000 -w 320 -h 240 -fps 10 --raw - -rf gray  -o video.264 | ./img_proc | mplayer -demuxer rawvideo -rawvideo w=320:h=240:fps=10:format=y8 -vo x11 -vf scale -cache 32 -
+// color (INPUT_CHROMA CHROMA_I420): ... --raw - -rf yuv ... | ./img_proc | mplayer ... format=i420 ...
 
 
 
 #define FILE_IO
 
-char* SETTINGS_FILENAME="./settings.txt"; // file for storing settings, IMPORTANT: use the same as in the other programm
+// several cameras in one process (live video, opt-in): every stream has its own input (raw frames, e.g. a named pipe
+// fed by raspivid), output and settings file and is read, planned and written by its own thread with its own buffers;
+// the filters are cut into bands of lines that the stream computes itself and that a shared pool of worker threads
+// steals from the streams, a stream with priority p gets p shares of the pool, so the cores are balanced and a heavy
+// stream cannot hold back the others (all streams have the size W x H, the OpenMP loops run in the stream threads only)
+
+#ifndef FILE_IO
+  //#define MULTI_STREAM
+#endif
+
+typedef struct
+{
+	char *input;     // raw frames of W x H pixels
+	char *output;    // name of the first output sink ("-": stdout)
+	char *settings;  // settings file of the stream
+	int priority;    // shares of the worker pool
+} stream_config;
+
+stream_config streams[] = { { "/tmp/cam0", "/tmp/view0", "./settings0.txt", 2 }, { "/tmp/cam1", "/tmp/view1", "./settings1.txt", 1 } };
+#define STREAMS (int)(sizeof(streams)/sizeof(streams[0]))
+
+#define POOL_WORKERS  0   // worker threads of the pool (0: one per core)
+#define BAND_LINES    32  // lines of a band
+
+#ifdef MULTI_STREAM
+  #define STREAM_LOCAL __thread  // state of a stream, every thread has its own copy
+#else
+  #define STREAM_LOCAL
+#endif
+
+STREAM_LOCAL char* SETTINGS_FILENAME="./settings.txt"; // file for storing settings, IMPORTANT: use the same as in the other programm
+
+// the settings file is either the output of userio (one number per line: fir, median, zoom, brightness,
+// flip, rotation, exposure) or a list of stages in the order they are applied, one per line:
+//   name [value ...] [parameter=value ...]   # comment
+// e.g. "fir", "median", "box radius=15", "gauss sigma=4", "kernel sharpen.txt",
+//      "edge scharr=1 norm=2 output=2", "morph op=2 width=9 height=9", "zoom 2", "brightness offset=20 auto=1",
+//      "temporal strength=75 noise=8", "flip axis=3", "rotation angle=90", "remap k1=-150 vignette=40", "remap lens.txt"
+// stages may be repeated, the planner reorders and fuses them (see stage_types[] for names and parameters)
 
 // define width and height of the image / video
 #ifdef FILE_IO	
   #define W 1280  // image width
   #define H 960  // image height
-  char* INPUT_FILENAME="./Bilder/test_bild_original.raw"; // input file (raw image data = pgm file without header)
-  char* OUTPUT_FILENAME="./Bilder/out.pgm";                      // processed output file (pgm file)
+  char* INPUT_FILENAME="./Bilder/test_bild_original.raw"; // input file (raw image data = pgm file without header, .pgm, .y4m or .ipc)
+  char OUTPUT_FILENAME[]="./Bilder/out.pgm";                     // processed output file (pgm file)
+  //#define STILL_IMAGE_TUNING  // single image: keep it after processing, process it again whenever the settings change
 #else
   #define W 360  // video width
   #define H 240  // video height
 #endif
 
+// pixel depth: 8 bit or 10, 12, 16 bit sensors (values 0 ... PIXEL_MAX, stored in 16 bits); the parameters of the
+// stages and the histograms of the brightness control stay on the 8 bit scale (offset=20 is 20/255 of the range);
+// raw frames of more than 8 bit are 16 bit words (little endian) or packed as the sensors send them:
+// RAW_PACKING 10 (4 pixels in 5 bytes) or 12 (2 pixels in 3 bytes), the lines are unpacked while they are read
+#define PIXEL_BITS   8
+#define RAW_PACKING  0  // 0: not packed
+
+#if PIXEL_BITS > 8
+  typedef uint16_t pixel;
+  typedef uint32_t pixel_sum;   // sum of up to 64 pixels
+  typedef int32_t pixel_diff;   // sums and differences of a few pixels (gradients)
+#else
+  typedef uint8_t pixel;
+  typedef uint16_t pixel_sum;
+  typedef int16_t pixel_diff;
+#endif
+#define PIXEL_MAX    ((1<<PIXEL_BITS)-1)
+#define PIXEL_SHIFT  (PIXEL_BITS-8)  // pixel value >> PIXEL_SHIFT: 8 bit scale
+
+// color video: raw frames may carry the chroma (4:2:0) behind the luma plane, the stages process the luma only,
+// the chroma is written as it was read when the plan has no geometric stages (no copy) or moved with the zoom,
+// flips and rotations of the plan at chroma resolution; raw and .y4m outputs get the chroma, PGM and .ipc outputs
+// the luma, a .y4m input provides its chroma if it is 4:2:0 (other inputs: neutral chroma)
+#define CHROMA_GRAY   0  // luma only
+#define CHROMA_I420   1  // planes U and V of W/2 x H/2 pixels (raspivid -rf yuv)
+#define CHROMA_NV12   2  // one plane of W/2 x H/2 pairs U, V
+#define INPUT_CHROMA  CHROMA_GRAY
+
+
+// outputs: every processed frame is written to all sinks, a sink with level l gets the frame binned
+// by 2^l x 2^l pixels (pyramid), all levels are computed from the final image in the pass that writes
+// it, so the processing runs only once; "-" is stdout, names ending with .pgm get a PGM header,
+// names ending with .ipc are compressed without loss (the file can be used as INPUT_FILENAME),
+// names ending with .y4m are written as YUV4MPEG2 video (grayscale, Cmono or Cmono10 ... Cmono16 with more than 8 bit,
+// with INPUT_CHROMA C420jpeg or C420p10 ..., see above)
+// example for live video with a full resolution recording and a preview: W 720, H 480,
+// raspivid ... -w 720 -h 480 ... | ./img_proc | mplayer ... w=360:h=240 ... with the sinks { .name = "-", .level = 1 }, { .name = "record.raw" }
+
+#define MAX_LEVEL 3  // smallest preview 1/8 of the frame
+
+typedef struct
+{
+	char *name;  // file name or "-"
+	int level;   // pyramid level 0 ... MAX_LEVEL
+	FILE *file;
+	pixel *frame;           // frame for compressed outputs
+	uint8_t *code;          // its code
+	off_t *index;           // offsets of the frames in an .ipc file
+	long frames;
+	char *part;             // file for the frames of one process (see JOBS), without header and index
+	int big_endian;         // 16 bit pixels with the high byte first (PGM)
+} output_sink;
+
+#ifdef FILE_IO
+  STREAM_LOCAL output_sink outputs[] = { { .name = OUTPUT_FILENAME } /*, { .name = "./Bilder/preview.pgm", .level = 2 } */ };
+#else
+  STREAM_LOCAL output_sink outputs[] = { { .name = "-" } /*, { .name = "record.raw" } */ };
+#endif
+#define OUTPUTS (int)(sizeof(outputs)/sizeof(outputs[0]))
+
+
+// FILE_IO: the input may be raw frames, a PGM file (frames behind one header, as written by the outputs), an .ipc
+// recording or a YUV4MPEG2 file (.y4m, only the luma plane is used), the frames must have W x H pixels;
+// all of them can be read from any frame on (.ipc recordings get a table with the offsets of the frames at the end)
+// command line "img_proc [first frame [number of frames]] [--jobs n]" processes a part of the input, e.g. to resume
+// a run, the frames are split into ranges that are processed in parallel by JOBS processes,
+// the parts of the outputs are joined at the end
+// command line "img_proc --batch [--out dir] [--shard i/N] [--jobs n] input ..." processes many files: the inputs are
+// directories (their .raw, .pgm, .y4m and .ipc files), patterns (e.g. "archiv/*.y4m") or lists ("@list.txt", one name
+// per line), every file is processed by a process of the pool, the outputs are "dir/<file name>.<output file name>";
+// with --shard i/N only the files i, i+N, i+2N, ... of the sorted list are processed (machines share an archive
+// without coordination)
+
+#define JOBS             0   // processes (0: one per core)
+#define JOB_MIN_FRAMES   8   // smallest range of frames for a process
+#define FRAME_WARMUP     16  // frames in front of a range that are processed without output (settles the auto exposure)
+#define BATCH_OUTPUT_DIR "./Bilder/batch"
+
 
 // define FIR filter settings (select one)
 
@@ -108,17 +251,116 @@ char* SETTINGS_FILENAME="./settings.txt"; // file for storing settings, IMPORTAN
 #endif	
 
 
+// box blur and its gaussian approximation (stages "box" and "gauss"), the cost per pixel does not depend on the window
+
+#define BOX_MAX_RADIUS   15  // largest window 31x31
+#define GAUSS_MAX_PASSES 5   // max. number of box blurs for the gaussian
+
+
+// morphology with a rectangle (stage "morph": erosion, dilation, opening, closing, top-hat),
+// min/max after van Herk/Gil-Werman with three comparisons per pixel and direction for any size
+
+#define MORPH_MAX_RADIUS 31  // largest rectangle 63x63
+
+
+// user kernels (stage "kernel file=name"), large kernels are convolved with FFT
+
+#define KERNEL_MAX   64    // largest kernel 64x64
+#define MAX_KERNELS  4     // kernels in one pipeline
+#define FFT_MAX      512   // largest FFT size
+#define FFT_LOG_MAX  9     // log2(FFT_MAX)
+#define FFT_COST     4.0   // cost of a block of the FFT convolution in multiply-adds per n*n*(log2(n)+4) (measured)
+
+
+// lens correction (stage "remap"): a table with the source position of every output pixel, computed from a radial
+// model or a grid file, applied with bilinear interpolation and an optional gain for the vignetting
+
+#define REMAP_FRAC       4   // fractional bits of the source positions (1/16 pixel)
+#define REMAP_GAIN_BITS  12  // fixed point of the gains
+#define REMAP_TILE       32  // the table is stored in tiles of REMAP_TILE x REMAP_TILE output pixels
+
+
 // for estimation of realtime processing of Full-HD@30fps video
 
 //#define REALTIME_PROCESSING_SIMULATION
 const int realtime_factor = (1920*1080*30)/(W*H); 
 
+
+// deadline scheduler for live video: when a frame would miss its deadline, the quality is reduced
+// in the order given by degrade_policy and restored when there is enough headroom again
+
+#ifndef FILE_IO
+  #define DEADLINE_SCHEDULER
+#endif
+#define FRAME_INTERVAL_MS  100.0  // target frame interval (raspivid -fps 10)
+#define SCHED_LIMIT        0.9    // reduce quality when the predicted time exceeds this part of the interval
+#define SCHED_HEADROOM     0.6    // restore quality when the better level is predicted below this part
+#define SCHED_RESTORE      10     // ... for this number of frames in a row
+#define SCHED_QUEUED_MS    1.0    // a frame read faster than this was waiting in the pipe (frames are dropped only then)
+
+enum { DEGRADE_FIR, DEGRADE_MEDIAN, DEGRADE_HALF_RES, DEGRADE_DROP };
+int degrade_policy[] = { DEGRADE_MEDIAN, DEGRADE_HALF_RES, DEGRADE_DROP };  // order of the quality reductions
+
+
+// slice streaming for live video: the frame is read, processed and written in slices of lines, so the output
+// starts while the camera still sends the frame (plans of filters, brightness changes and horizontal flips)
+
+#ifndef FILE_IO
+  #define SLICE_STREAMING
+#endif
+#define SLICE_LINES  16  // lines read at once
+
+
+// real-time mode (opt-in): the thread reading, processing and writing the frames and the other OpenMP threads
+// are pinned to the given cores and run with real-time priority, all memory is locked and the buffers are
+// touched before the first frame (no page faults while processing); needs root or the capabilities
+// CAP_SYS_NICE and CAP_IPC_LOCK (sudo setcap cap_sys_nice,cap_ipc_lock+ep img_proc)
+
+//#define REALTIME_MODE
+#define RT_POLICY           SCHED_FIFO  // or SCHED_RR
+#define RT_IO_PRIORITY      60          // thread with the input and output (1 ... 99)
+#define RT_WORKER_PRIORITY  50          // other OpenMP threads
+int rt_io_core = 0;                     // core of the I/O thread (-1: any)
+int rt_worker_cores[] = { 1, 2, 3 };    // cores of the other OpenMP threads, one thread each
+#define RT_STACK_PREFAULT   (256*1024)  // bytes of the stack touched in advance
+
+// hardware performance counters (cycles, instructions, cache and branch misses) are read around every stage
+// and reported per stage at the end (Linux perf_event_open, user space only, allowed with perf_event_paranoid <= 2;
+// with OpenMP only the master thread is counted, build without -fopenmp for complete numbers)
+
+//#define STAGE_COUNTERS
+
+// timeline trace (opt-in): reading, settings reloads, every stage and writing of every frame are recorded with their
+// begin and end in a ring buffer per thread and written as Chrome trace events (chrome://tracing, ui.perfetto.dev)
+// at the end, at Ctrl+C and on "kill -USR1 <pid>" (after the next frame); processes of a pool write TRACE_FILENAME.<pid>
+
+//#define FRAME_TRACE
+#define TRACE_FILENAME  "./trace.json"
+#define TRACE_EVENTS    65536  // last events kept per thread
+#define TRACE_THREADS   16     // threads with a ring buffer, events of other threads are not recorded
+
+// the deviations of the frame intervals from FRAME_INTERVAL_MS are counted and reported at the end (live video)
+#ifndef FILE_IO
+  #define JITTER_HISTOGRAM
+#endif
+#define JITTER_BIN_MS  0.5  // width of a histogram bin
+#define JITTER_BINS    41   // -10 ... +10 msec, the outer bins count all larger deviations
+
+
+// incremental processing: only the tiles of the input that changed since the last frame are filtered again,
+// the filter results of the other tiles are reused (static scenes, repeated frames)
+
+#ifdef FILE_IO
+  #define INCREMENTAL_PROCESSING
+#endif
+#define TILE_SIZE       32  // size of the tiles in pixels (not smaller than the window of the filters)
+#define TILE_THRESHOLD  0   // mean absolute difference per pixel (8 bit scale) up to which a tile is unchanged (0: exact comparison)
+
 /////////////////////////////////////////////////////////////////////////////// 
 /////////////////////////////////////////////////////////////////////////////// 
 
 
 
-typedef unsigned char uint8_t;
 FILE *log_file;  // file for writing status messages
 
 
@@ -145,6 +387,13 @@ FILE *log_file;  // file for writing status messages
   double get_time_ms() {
     return (double) (stop.QuadPart - start.QuadPart) / (freq.QuadPart/1000);
   }
+
+  double now_ms() {  // time stamp for measuring single stages
+    LARGE_INTEGER t,f;
+    QueryPerformanceCounter(&t);
+    QueryPerformanceFrequency(&f);
+    return (double) t.QuadPart / (f.QuadPart/1000);
+  }
 #else
 
   #include <sys/time.h>
@@ -166,427 +415,5457 @@ FILE *log_file;  // file for writing status messages
 	return ( stop.tv_sec * 1000 + (double)stop.tv_usec/1000 )
 	      - (start.tv_sec * 1000 + (double)start.tv_usec/1000); 
   }
+
+  double now_ms() {  // time stamp for measuring single stages (monotonic)
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC,&t);
+    return t.tv_sec * 1000.0 + t.tv_nsec / 1000000.0;
+  }
 #endif
 /////////////////////////////////////////////////////////////////////////////// 
 /////////////////////////////////////////////////////////////////////////////// 
 
 /////////////////////////////////////////////////////////////////////////////// 
-// file I/O functions
+// timeline trace (see FRAME_TRACE)
+// every thread writes its events into its own ring buffer (no locks), the buffers are written as
+// Chrome trace events ("ph":"X" with begin and duration in microseconds) when the frames are done
 /////////////////////////////////////////////////////////////////////////////// 
-FILE *open_file(char *filename, char *flags) 
+
+typedef struct
 {
-	FILE *img = fopen(filename, flags);  // open raw file
-	if (img == NULL)                        // check if opening worked fine
-	{
-		fprintf(log_file,"Error opening file %s ==> exit.\n",filename);
-		exit(-1);
-	}
-	return img;
+	const char *name;  // stage or activity
+	long frame;        // frame number (-1: before the first frame)
+	double begin, end; // msec, now_ms()
+} trace_event;
+
+typedef struct
+{
+	trace_event *event;  // TRACE_EVENTS, allocated on the first event of the thread
+	unsigned long count; // events recorded, the last TRACE_EVENTS are kept
+} trace_ring;
+
+trace_ring trace_rings[TRACE_THREADS];
+int trace_threads = 0;                          // rings in use
+STREAM_LOCAL long trace_frame = -1;             // frame of the following events
+double trace_origin;                            // time of the trace start
+volatile sig_atomic_t trace_dump_requested = 0; // SIGUSR1
+volatile sig_atomic_t stop_requested = 0;       // SIGINT, SIGTERM: finish the current frame and end
+
+double trace_begin()  // time stamp for the begin of an event (0 without trace)
+{
+#ifdef FRAME_TRACE
+	return now_ms();
+#else
+	return 0;
+#endif
 }
-	
-int read_image(uint8_t img_array[H][W], FILE* img) 
+
+void trace_end(const char *name, double begin)  // record an event from begin until now
 {
-	int length = fread(img_array,1,W*H,img);  // read file data to img_array
-	if (length != W*H)                        // check if reading worked fine
+#ifdef FRAME_TRACE
+	trace_ring *r;
+	trace_event *e;
+	static __thread int t = -1;  // ring of this thread
+
+	if (t < 0)
 	{
-		fprintf(log_file,"no more data in input image\n");
-		return 0;
+		t = __sync_fetch_and_add(&trace_threads,1);
 	}
-	return 1;
+	if (t >= TRACE_THREADS)
+	{
+		return;
+	}
+	r = &trace_rings[t];
+	if (r->event == NULL && (r->event = malloc(TRACE_EVENTS*sizeof(trace_event))) == NULL)
+	{
+		return;
+	}
+	e = &r->event[r->count++ % TRACE_EVENTS];
+	e->name = name;
+	e->frame = trace_frame;
+	e->begin = begin;
+	e->end = now_ms();
+#else
+	(void)name;
+	(void)begin;
+#endif
 }
 
-void write_pgm_header(FILE *img) 
+#ifdef FRAME_TRACE
+static void trace_signal(int sig)
 {
-	char header[32];	
-	
-	sprintf(header,"P5\n%d %d\n255\n",W,H);     // create header
-	fwrite(header,1, strlen(header),img);     // copy header to pgm file
+	if (sig == SIGUSR1)
+	{
+		trace_dump_requested = 1;
+	}
+	else if (stop_requested)
+	{
+		_exit(1);  // second Ctrl+C
+	}
+	else
+	{
+		stop_requested = 1;
+	}
 }
+#endif
+
+char trace_filename[256] = TRACE_FILENAME;
 
-void write_image(uint8_t img_array[H][W], FILE *img) 
+void trace_dump()  // write all buffers (the whole file is rewritten each time)
 {
-	int length = fwrite(img_array,1,W*H,img); // write image data to output file
-	if (length != W*H)                        // check if writing worked fine
+#ifdef FRAME_TRACE
+	FILE *f;
+	const trace_event *e;
+	unsigned long i, first;
+	int t, n = 0;
+
+	for (t=0; t < TRACE_THREADS && trace_rings[t].count == 0; t++);
+	if (t == TRACE_THREADS)  // e.g. the process that only starts a pool
 	{
-		fprintf(log_file,"Error writing image ==> exit.\n");
-		exit (-1);
+		return;
 	}
+	if ((f = fopen(trace_filename,"w")) == NULL)
+	{
+		fprintf(log_file,"trace file %s cannot be written\n",trace_filename);
+		return;
+	}
+	fprintf(f,"{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	for (t=0; t < TRACE_THREADS; t++)
+	{
+		if (trace_rings[t].count == 0) continue;
+		fprintf(f,"%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}",
+		        n++ ? ",\n" : "",(int)getpid(),t,t);
+		first = trace_rings[t].count > TRACE_EVENTS ? trace_rings[t].count - TRACE_EVENTS : 0;
+		for (i=first; i < trace_rings[t].count; i++)
+		{
+			e = &trace_rings[t].event[i % TRACE_EVENTS];
+			fprintf(f,",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.1f,\"dur\":%.1f,\"pid\":%d,\"tid\":%d,\"args\":{\"frame\":%ld}}",
+			        e->name,(e->begin-trace_origin)*1000,(e->end-e->begin)*1000,(int)getpid(),t,e->frame);
+		}
+	}
+	fprintf(f,"\n]}\n");
+	fclose(f);
+#endif
 }
 
+void trace_start(int child)  // start (again) in this process, child: process of a pool
+{
+#ifdef FRAME_TRACE
+	struct sigaction sa;
+	int t;
 
+	for (t=0; t < TRACE_THREADS; t++)
+	{
+		trace_rings[t].count = 0;  // events of the parent
+	}
+	if (child)
+	{
+		snprintf(trace_filename,sizeof(trace_filename),"%s.%d",TRACE_FILENAME,(int)getpid());
+	}
+	else
+	{
+		atexit(trace_dump);
+		memset(&sa,0,sizeof(sa));
+		sa.sa_handler = trace_signal;
+		sigaction(SIGINT,&sa,NULL);  // no SA_RESTART: a blocking read of the input returns
+		sigaction(SIGTERM,&sa,NULL);
+		sa.sa_flags = SA_RESTART;
+		sigaction(SIGUSR1,&sa,NULL);
+	}
+	trace_origin = now_ms();
+#else
+	(void)child;
+#endif
+}
 /////////////////////////////////////////////////////////////////////////////// 
 /////////////////////////////////////////////////////////////////////////////// 
 
+///////////////////////////////////////////////////////////////////////////////
+// lossless compression (.ipc files)
+// every frame is cut into slices of lines that are coded independently (in parallel with OpenMP):
+// each pixel is predicted from its neighbours (median edge detector as in JPEG-LS) and the
+// prediction error is written with a Golomb-Rice code whose parameter adapts to the mean error
+// frame: "IPCF", width, height, number of slices, bits per pixel (16 bit each, little endian, 0: 8 bit),
+// the sizes of the slices in bytes (32 bit each) and the slices
+// file: the frames, the offsets of the frames (64 bit each), the offset of this table (64 bit) and "IPCX"
+///////////////////////////////////////////////////////////////////////////////
 
-/////////////////////////////////////////////////////////////////////////////// 
-// image processing funtions
-/////////////////////////////////////////////////////////////////////////////// 
+#define IPC_SLICES  8   // slices per frame
+#define IPC_ESCAPE  24  // errors with a longer unary part are written as escape and IPC_BITS bits
+#define IPC_HEADER  12  // bytes of the frame header (without the slice sizes)
+#define IPC_BITS    (8*(int)sizeof(pixel))        // errors are coded modulo 2^IPC_BITS
+#define IPC_RANGE   (1 << IPC_BITS)
+#define IPC_PIXEL_BYTES  ((IPC_ESCAPE+IPC_BITS+7)/8)  // longest code of a pixel
 
-void fir_filter(uint8_t out[H][W], uint8_t in[H][W])
+typedef struct
 {
-	int k,l,x,y;
-	int sum;
-	
-	for (y=(K>>1); y < H-(K>>1); y++)  // loop over all lines of frame
-	{
-		for (x=(K>>1); x < W-(K>>1); x++)  // loop over all rows of frame
-		{
-			// perform FIR filtering for each output pixel
-			sum = 0;	
-			for (k=0; k< K; k++)   // loop over all lines of filter window
-			{
-				for (l=0; l< K; l++) // loop over all rows of filter window
-				{
-					sum += c[k][l] * in[y-(K>>1)+k][x-(K>>1)+l];  // process each pixel in window
-					
-				}
-				
-			
-			}
-			sum = sum/g + h;  // scaling and offset
+	uint8_t *p;    // next byte
+	uint64_t acc;  // bits not written yet (first bit in bit 0)
+	int bits;
+} bit_stream;
 
-			if (sum < 0) sum = 0; //clipping
-			else if (sum > 255) sum=255;  
-			
-			out[y][x] = sum;  // write to output
-		}
+static inline void put_bits(bit_stream *b, uint32_t value, int n)  // n <= 32
+{
+	b->acc |= (uint64_t)value << b->bits;
+	b->bits += n;
+	if (b->bits >= 32)  // 4 bytes at once (little endian byte order is assumed, as for transpose8x8)
+	{
+		uint32_t v = b->acc;
+		memcpy(b->p,&v,4);
+		b->p += 4;
+		b->acc >>= 32;
+		b->bits -= 32;
 	}
 }
 
-void flip_horizontal(uint8_t out[H][W], uint8_t in[H][W]) // spiegeln
+// at least 57 bits in acc, behind the end of the code zeros are read and counted in missing (bytes)
+static inline void fill_bits(bit_stream *b, const uint8_t *end, int *missing)
 {
-	int x,y;
-	
-	for (y=0; y < H; y++)  // loop over all lines
+	while (b->bits <= 56)
 	{
-		for (x=0; x < (W/4)*4; x+=4)  // loop over all rows , Optimierung: 4-fach Loop-Unrolling
+		if (b->p < end)
 		{
-			out[y][x] = in[y][(W-1)-x];  // process each pixel
-			out[y][x+1] = in[y][(W-1)-(x+1)];
-			out[y][x+2] = in[y][(W-1)-(x+2)];
-			out[y][x+3] = in[y][(W-1)-(x+3)];
-			
-			
+			b->acc |= (uint64_t)*b->p++ << b->bits;
 		}
-		for (x = (W/4)*4; x < W; x++) //Optimierung: Restschleife von Loop-unrolling
+		else
 		{
-			out[y][x] = in[y][(W-1)-x];
+			(*missing)++;
 		}
+		b->bits += 8;
 	}
 }
 
-void change_brightness(uint8_t out[H][W], uint8_t in[H][W], int c)
+static inline uint32_t get_bits(bit_stream *b, int n)  // after fill_bits()
 {
-	int x,y;
-	int temp;
-	
-	for (y=0; y < H; y++)  // loop over all lines
+	uint32_t v = b->acc & ((1u<<n)-1);
+
+	b->acc >>= n;
+	b->bits -= n;
+	return v;
+}
+
+static inline int ipc_predict(const pixel *l, const pixel *u, int x, int first_line)
+{
+	int a,b,c,mx,mn,p;
+
+	if (first_line)  // the line before belongs to another slice
 	{
-		for (x=0; x < W; x++)  // loop over all rows
+		return x ? l[x-1] : IPC_RANGE/2;
+	}
+	if (x == 0)
+	{
+		return u[0];
+	}
+	a = l[x-1];  // left
+	b = u[x];    // up
+	c = u[x-1];  // up left
+	mx = a > b ? a : b;  // written without branches (conditional moves), the cases are not predictable
+	mn = a > b ? b : a;
+	p = a + b - c;
+	p = c >= mx ? mn : p;
+	return c <= mn ? mx : p;
+}
+
+static inline int ipc_k(unsigned int a, unsigned int n)  // Rice parameter for the mean error a/n
+{
+	int k = __builtin_clz(n) - __builtin_clz(a|1);  // smallest k with n*2^k >= a (without division)
+
+	k = k > 0 ? k : 0;
+	k += (n << k) < a;
+	return k < IPC_BITS-1 ? k : IPC_BITS-1;
+}
+
+// code the lines y0 ... y1-1 of an image, returns the number of bytes
+static size_t ipc_encode_slice(uint8_t *out, const pixel *img, int width, int y0, int y1)
+{
+	bit_stream b = { out, 0, 0 };
+	unsigned int a = 4, n = 1;  // sum and number of the last errors
+	int x,y,e,z,k,q;
+
+	for (y=y0; y < y1; y++)  // loop over all lines of the slice
+	{
+		const pixel *l = img + y*width;
+		for (x=0; x < width; x++)  // loop over all rows
 		{
-			temp = in[y][x] + c;
-			if (temp > 0)
+			e = ((l[x] - ipc_predict(l,y == y0 ? l : l-width,x,y == y0) + IPC_RANGE/2) & (IPC_RANGE-1)) - IPC_RANGE/2;  // error modulo 2^IPC_BITS
+			z = e >= 0 ? 2*e : -2*e-1;
+			k = ipc_k(a,n);
+			q = z >> k;
+			if (q < IPC_ESCAPE && q+1+k <= 32)  // unary part (q ones and a zero) and the k low bits
 			{
-				if (temp < 255)
-				{
-					out[y][x] = temp;  
-				}
-				else
-				{
-					out[y][x] = 255;
-				}
+				put_bits(&b,((1u<<q)-1) | (z & ((1<<k)-1)) << (q+1),q+1+k);
+			}
+			else if (q < IPC_ESCAPE)  // more than 8 bit: in two parts
+			{
+				put_bits(&b,(1u<<q)-1,q+1);
+				put_bits(&b,z & ((1<<k)-1),k);
 			}
 			else
 			{
-				out[y][x] = 0;
+				put_bits(&b,(1u<<IPC_ESCAPE)-1,IPC_ESCAPE);
+				put_bits(&b,z,IPC_BITS);
+			}
+			a += e >= 0 ? e : -e;
+			if (++n == 64)
+			{
+				a >>= 1;
+				n >>= 1;
 			}
-			
 		}
 	}
+	put_bits(&b,0,31);  // rest of the bits
+	if (b.bits > 0)
+	{
+		*b.p++ = b.acc;
+	}
+	return b.p - out;
 }
 
-//Quelle: http://homepages.inf.ed.ac.uk/rbf/BOOKS/PHILLIPS/
-void rotation(uint8_t out[H][W], uint8_t in[H][W],int angle_grad)
+// decode the lines y0 ... y1-1 from the code in ... end-1, returns 0 if the code is too short (damaged)
+static int ipc_decode_slice(pixel *img, const uint8_t *in, const uint8_t *end, int width, int y0, int y1)
 {
-	int x,y,x_out,y_out;
-	int temp;
-	double c,s;
-	double angle_rad = (double)angle_grad*3.14159265359/180;
-	c = cos(angle_rad);
-	s = sin(angle_rad);
-	double center_x = (double)W/2;
-	double center_y = (double)H/2;
-	
-	for (y=0; y < H; y++)  // loop over all lines
+	bit_stream b = { (uint8_t *)in, 0, 0 };
+	unsigned int a = 4, n = 1;
+	int x,y,e,z,k,q,missing = 0;
+
+	for (y=y0; y < y1; y++)  // loop over all lines of the slice
 	{
-		for (x=0; x < W; x++)  // loop over all rows
+		pixel *l = img + y*width;
+		for (x=0; x < width; x++)  // loop over all rows
 		{
-			x_out = center_x + ((double)(y)-center_y)*s+((double)(x)-center_x)*c;
-			y_out = center_y + ((double)(y)-center_y)*c-((double)(x)-center_x)*s;
-			
-			temp = 0; //in case the original pixel is not available
-			if(x_out >= 0 && x_out <= W && y_out >= 0 && y_out <= H)
+			k = ipc_k(a,n);
+			fill_bits(&b,end,&missing);
+			q = ~b.acc ? __builtin_ctzll(~b.acc) : 64;  // number of ones
+			if (q < IPC_ESCAPE)
 			{
-				 temp = in[y_out][x_out];
+				get_bits(&b,q+1);
+				z = (q << k) | get_bits(&b,k);
 			}
-			out[y][x] = temp;
+			else
+			{
+				get_bits(&b,IPC_ESCAPE);
+				z = get_bits(&b,IPC_BITS);
+			}
+			e = z & 1 ? -(z+1)/2 : z/2;
+			l[x] = ipc_predict(l,y == y0 ? l : l-width,x,y == y0) + e;
+			a += e >= 0 ? e : -e;
+			if (++n == 64)
+			{
+				a >>= 1;
+				n >>= 1;
+			}
+		}
+		if (b.bits < 8*missing)  // the line used bits behind the end of the code
+		{
+			return 0;
 		}
 	}
+	return 1;
 }
 
-//Quelle: http://homepages.inf.ed.ac.uk/rbf/BOOKS/PHILLIPS/
-void zoom(uint8_t out[H][W], uint8_t in[H][W], int faktor)
+static void put16(uint8_t *p, unsigned int v)
 {
-	  
-	   int x,y;
-	   int A,B,C,D;	   
-	   int hf = H/faktor;
-	   int wf = W/faktor;
-	  	
-	   	
-	for(A=0; A<faktor; A++) // loop over factor
-	{
-       for(B=0; B<faktor; B++) // loop over factor
-       {
-        for(y=0; y<(hf); y++) // loop over all lines of frame
-        {
-         for(x=0; x<(wf); x++) // loop over all rows of frame
-         {
-          for(C=0; C<faktor; C++) // loop over factor
-          {
-           for(D=0; D<faktor; D++) // loop over factor
-           {
-             out[faktor*y+C][faktor*x+D] = in[y+A*((hf)>>1)][x+B*((wf)>>1)]; // replicate every element and write to output
-           } 
-          }  
-         }  
-        }   
-	   }
-	}
+	p[0] = v;
+	p[1] = v >> 8;
 }
 
+static void put32(uint8_t *p, uint32_t v)
+{
+	put16(p,v);
+	put16(p+2,v >> 16);
+}
 
+static uint32_t get32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
 
-void median_filter(uint8_t out[H][W], uint8_t in[H][W])
+static void put64(uint8_t *p, uint64_t v)
 {
-	int s = 3; //size of filter window
-	int ds=s>>1;
-	int x,y, j, k ;
-	int pixel[9]; // Declare the chosen 3x3 Pixels
-	int tmp;
-	
-	
-	for (y=ds; y < H - ds; y ++)  // loop over all lines of frame
-	{
-		for (x=ds; x < W-ds; x ++)  // loop over all rows of frame
-		{
-			// 3x3 will be taken
-			pixel[0] = in[y-1][x-1];
-			pixel[1] = in[y-1][x];
-			pixel[2] = in[y-1][x+1];
-		  
-			pixel[3] = in[y][x-1];
-			pixel[4] = in[y][x];
-			pixel[5] = in[y][x+1];
-		 
-			pixel[6] = in[y+1][x-1];
-			pixel[7] = in[y+1][x];
-			pixel[8] = in[y+1][x+1];
-			
-			// Sort-Algorithm: the chosen 3x3 Pixels will be sort
-			for ( j = 0; j < 9; j ++)			  
-		    {  
-			    for( k = j+1; k< 9 ; k ++)			   
-				{
-					if( pixel[j] < pixel[k])			      
-					{
-						tmp = pixel[j];
-						pixel[j]=pixel[k];
-						pixel[k]=tmp;
-   
-					}
-			    }
-			}
-			 
-			out[y][x] = pixel[4];
-			 	    
-		}
-	}
+	put32(p,v);
+	put32(p+4,v >> 32);
 }
 
-void array_copy(uint8_t out[H][W], uint8_t in[H][W])
+static uint64_t get64(const uint8_t *p)
 {
-	int x,y;
-	
-	for (y=0; y < H; y++)  // loop over all lines
+	return get32(p) | (uint64_t)get32(p+4) << 32;
+}
+
+// code a frame, code needs IPC_HEADER + 4*IPC_SLICES + IPC_PIXEL_BYTES*width*height bytes
+size_t ipc_encode(uint8_t *code, const pixel *img, int width, int height)
+{
+	uint8_t *data = code + IPC_HEADER + 4*IPC_SLICES;
+	size_t size[IPC_SLICES], pos = 0;
+	int i;
+
+	#pragma omp parallel for schedule(dynamic)
+	for (i=0; i < IPC_SLICES; i++)  // each slice into its own part of the buffer
+	{
+		double t = trace_begin();
+		size[i] = ipc_encode_slice(data + (size_t)IPC_PIXEL_BYTES*width*(height*i/IPC_SLICES),img,width,height*i/IPC_SLICES,height*(i+1)/IPC_SLICES);
+		trace_end("ipc encode",t);
+	}
+	memcpy(code,"IPCF",4);
+	put16(code+4,width);
+	put16(code+6,height);
+	put16(code+8,IPC_SLICES);
+	put16(code+10,IPC_BITS > 8 ? IPC_BITS : 0);
+	for (i=0; i < IPC_SLICES; i++)  // close the gaps between the slices
+	{
+		put32(code + IPC_HEADER + 4*i,size[i]);
+		memmove(data+pos,data + (size_t)IPC_PIXEL_BYTES*width*(height*i/IPC_SLICES),size[i]);
+		pos += size[i];
+	}
+	return IPC_HEADER + 4*IPC_SLICES + pos;
+}
+
+// read the header of an .ipc frame and the offsets of the slices in its code,
+// returns the number of slices (0: no frame)
+static int read_ipc_header(FILE *img, size_t offset[257])
+{
+	uint8_t header[IPC_HEADER + 4*256];
+	int i, slices;
+
+	if (fread(header,1,IPC_HEADER,img) != IPC_HEADER)
+	{
+		fprintf(log_file,"no more data in input image\n");
+		return 0;
+	}
+	slices = header[8] | header[9] << 8;
+	if (memcmp(header,"IPCF",4) != 0 || (header[4] | header[5] << 8) != W || (header[6] | header[7] << 8) != H ||
+	    (header[10] | header[11] << 8) != (IPC_BITS > 8 ? IPC_BITS : 0) ||
+	    slices < 1 || slices > 256 || fread(header+IPC_HEADER,4,slices,img) != (size_t)slices)
+	{
+		fprintf(log_file,"input is no .ipc file with %dx%d pixels of %d bit\n",W,H,IPC_BITS);
+		return 0;
+	}
+	offset[0] = 0;
+	for (i=0; i < slices; i++)
+	{
+		offset[i+1] = offset[i] + get32(header + IPC_HEADER + 4*i);
+	}
+	return slices;
+}
+
+// read and decode a frame of an .ipc file
+int read_ipc_image(pixel img_array[H][W], FILE *img)
+{
+	static uint8_t *code = NULL;
+	static size_t code_size = 0;
+	size_t offset[257], total;
+	int i, slices;
+
+	if ((slices = read_ipc_header(img,offset)) == 0)
+	{
+		return 0;
+	}
+	total = offset[slices];
+	if (total > code_size)
+	{
+		free(code);
+		code_size = total;
+		code = calloc(code_size,1);
+		if (code == NULL)
+		{
+			fprintf(log_file,"Error allocating memory ==> exit.\n");
+			exit(-1);
+		}
+	}
+	if (fread(code,1,total,img) != total)
+	{
+		fprintf(log_file,"no more data in input image\n");
+		return 0;
+	}
+
+	#pragma omp parallel for schedule(dynamic)
+	for (i=0; i < slices; i++)  // a damaged slice is black, the others are decoded
+	{
+		double t = trace_begin();
+		if (!ipc_decode_slice(&img_array[0][0],code + offset[i],code + offset[i+1],W,H*i/slices,H*(i+1)/slices))
+		{
+			memset(img_array[H*i/slices],0,(size_t)(H*(i+1)/slices - H*i/slices)*sizeof(img_array[0]));
+			fprintf(log_file,"slice %d of the .ipc frame is damaged\n",i);
+		}
+		trace_end("ipc decode",t);
+	}
+	return 1;
+}
+
+static void add_offset(off_t **index, long *count, off_t offset)  // append to a table of frame offsets
+{
+	if ((*count & (*count-1)) == 0)  // grows to the next power of 2
+	{
+		*index = realloc(*index,(*count ? 2 * *count : 1)*sizeof(off_t));
+		if (*index == NULL)
+		{
+			fprintf(log_file,"Error allocating memory ==> exit.\n");
+			exit(-1);
+		}
+	}
+	(*index)[(*count)++] = offset;
+}
+
+// find the frames of .ipc data that has no table of offsets (a part or a recording that was not closed),
+// returns the number of complete frames
+long ipc_walk(FILE *img, off_t size, off_t **index)
+{
+	size_t offset[257];
+	off_t pos = 0;
+	long count = 0;
+	int slices;
+
+	while (pos + IPC_HEADER <= size && fseeko(img,pos,SEEK_SET) == 0 && (slices = read_ipc_header(img,offset)) > 0 &&
+	       pos + IPC_HEADER + 4*slices + (off_t)offset[slices] <= size)
+	{
+		add_offset(index,&count,pos);
+		pos += IPC_HEADER + 4*slices + offset[slices];
+	}
+	return count;
+}
+
+// table of the frame offsets at the end of an .ipc file
+void write_ipc_index(FILE *img, const off_t *index, long count)
+{
+	uint8_t entry[12];
+	off_t table = ftello(img);
+	long i;
+
+	for (i=0; i < count; i++)
+	{
+		put64(entry,index[i]);
+		fwrite(entry,1,8,img);
+	}
+	put64(entry,table);
+	memcpy(entry+8,"IPCX",4);
+	if (fwrite(entry,1,12,img) != 12)
+	{
+		fprintf(log_file,"Error writing image ==> exit.\n");
+		exit (-1);
+	}
+}
+
+// read the table of frame offsets of an .ipc file, returns the number of frames (-1: no table)
+long read_ipc_index(FILE *img, off_t size, off_t **index)
+{
+	uint8_t entry[12];
+	off_t table;
+	long i, count;
+
+	if (size < 12 || fseeko(img,size-12,SEEK_SET) != 0 || fread(entry,1,12,img) != 12 || memcmp(entry+8,"IPCX",4) != 0)
+	{
+		return -1;
+	}
+	table = get64(entry);
+	count = (size - 12 - table) / 8;
+	if (table < 0 || table + 8*count + 12 != size || fseeko(img,table,SEEK_SET) != 0)
+	{
+		return -1;
+	}
+	*index = malloc((count+1)*sizeof(off_t));
+	if (*index == NULL)
+	{
+		fprintf(log_file,"Error allocating memory ==> exit.\n");
+		exit(-1);
+	}
+	for (i=0; i < count; i++)
+	{
+		if (fread(entry,1,8,img) != 8)
+		{
+			free(*index);
+			*index = NULL;
+			return -1;
+		}
+		(*index)[i] = get64(entry);
+	}
+	return count;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////// 
+// file I/O functions
+/////////////////////////////////////////////////////////////////////////////// 
+FILE *open_file(char *filename, char *flags) 
+{
+	FILE *img = fopen(filename, flags);  // open raw file
+	if (img == NULL)                        // check if opening worked fine
+	{
+		fprintf(log_file,"Error opening file %s ==> exit.\n",filename);
+		exit(-1);
+	}
+	return img;
+}
+	
+enum { INPUT_RAW, INPUT_IPC, INPUT_Y4M };
+
+typedef struct
+{
+	int format;        // INPUT_...
+	off_t start;       // offset of the first frame
+	off_t frame_size;  // bytes of a frame with its header (0: .ipc, the frames have different sizes)
+	off_t chroma;      // bytes of the color planes behind the luma plane (.y4m)
+	long frames;       // number of frames (-1: unknown, stdin)
+	off_t *index;      // offsets of the frames (.ipc)
+	int packing;       // RAW_PACKING of raw frames (0: one pixel per byte or 16 bit word)
+	int big_endian;    // 16 bit pixels with the high byte first (PGM)
+	int chroma_layout; // CHROMA_... of the chroma read with the frames (CHROMA_GRAY: none, neutral chroma)
+} input_info;
+
+#if RAW_PACKING && (RAW_PACKING > PIXEL_BITS || W % 4 != 0 || INPUT_CHROMA != CHROMA_GRAY)
+  #error "packed raw frames need PIXEL_BITS >= RAW_PACKING, a width that is a multiple of 4 and no chroma"
+#endif
+#define CHROMA_PIXELS   (INPUT_CHROMA != CHROMA_GRAY ? (W/2)*(H/2) : 1)  // of one component
+#define RAW_FRAME_SIZE  ((off_t)W*H*(RAW_PACKING ? RAW_PACKING : 8*(int)sizeof(pixel))/8 + \
+                         (INPUT_CHROMA != CHROMA_GRAY ? 2*(off_t)CHROMA_PIXELS*sizeof(pixel) : 0))
+
+STREAM_LOCAL input_info input = { INPUT_RAW, 0, RAW_FRAME_SIZE, 0, -1, NULL, RAW_PACKING, 0, INPUT_CHROMA };
+STREAM_LOCAL pixel chroma_in[2*CHROMA_PIXELS];  // chroma of the current frame in input.chroma_layout
+
+// read the chroma behind the luma plane, frames without chroma keep the neutral one
+int read_chroma(FILE *img)
+{
+	if (INPUT_CHROMA == CHROMA_GRAY || input.chroma_layout == CHROMA_GRAY)
+	{
+		return 1;
+	}
+	return fread(chroma_in,sizeof(pixel),2*CHROMA_PIXELS,img) == 2*CHROMA_PIXELS;
+}
+
+// read the lines y0 ... y1-1 of a raw or PGM frame, packed lines are unpacked while they are still in the cache
+int read_raw_lines(pixel img_array[H][W], int y0, int y1, FILE *img)
+{
+	static STREAM_LOCAL uint8_t packed[W*2];
+	size_t n = input.packing ? (size_t)(W*input.packing/8) : W*sizeof(pixel);
+	int x, y;
+
+	if (input.packing == 0 && !input.big_endian)
+	{
+		return fread(img_array[y0],sizeof(pixel),(size_t)(y1-y0)*W,img) == (size_t)(y1-y0)*W;
+	}
+	for (y=y0; y < y1; y++)
+	{
+		pixel *l = img_array[y];
+		const uint8_t *p = input.packing ? packed : (uint8_t *)l;  // 16 bit PGM is swapped in place
+
+		if (fread((void *)p,1,n,img) != n)
+		{
+			return 0;
+		}
+		if (input.packing == 10)  // bits 9 ... 2 of 4 pixels, then their bits 1 ... 0 in one byte
+		{
+			for (x=0; x < W; x+=4, p+=5)
+			{
+				l[x]   = p[0] << 2 | (p[4] & 3);
+				l[x+1] = p[1] << 2 | (p[4] >> 2 & 3);
+				l[x+2] = p[2] << 2 | (p[4] >> 4 & 3);
+				l[x+3] = p[3] << 2 | p[4] >> 6;
+			}
+		}
+		else if (input.packing == 12)  // bits 11 ... 4 of 2 pixels, then their bits 3 ... 0 in one byte
+		{
+			for (x=0; x < W; x+=2, p+=3)
+			{
+				l[x]   = p[0] << 4 | (p[2] & 15);
+				l[x+1] = p[1] << 4 | p[2] >> 4;
+			}
+		}
+		else
+		{
+			for (x=0; x < W; x++)
+			{
+				l[x] = p[2*x] << 8 | p[2*x+1];
+			}
+		}
+	}
+	return 1;
+}
+
+int read_y4m_image(pixel img_array[H][W], FILE *img)
+{
+	char tag[5];
+	int c;
+
+	if (fread(tag,1,5,img) != 5 || memcmp(tag,"FRAME",5) != 0)
+	{
+		fprintf(log_file,"no more data in input image\n");
+		return 0;
+	}
+	while ((c = getc(img)) != '\n' && c != EOF);  // frame parameters
+	if (fread(img_array,sizeof(pixel),W*H,img) != W*H ||
+	    (input.chroma_layout != CHROMA_GRAY ? !read_chroma(img) : fseeko(img,input.chroma,SEEK_CUR) != 0))
+	{
+		fprintf(log_file,"no more data in input image\n");
+		return 0;
+	}
+	return 1;
+}
+
+int read_image(pixel img_array[H][W], FILE* img) 
+{
+	if (input.format == INPUT_IPC)
+	{
+		return read_ipc_image(img_array,img);
+	}
+	if (input.format == INPUT_Y4M)
+	{
+		return read_y4m_image(img_array,img);
+	}
+	if (!read_raw_lines(img_array,0,H,img) || !read_chroma(img))  // read file data to img_array
+	{
+		fprintf(log_file,"no more data in input image\n");
+		return 0;
+	}
+	return 1;
+}
+
+void write_pgm_header(FILE *img, int width, int height) 
+{
+	char header[32];	
+	
+	sprintf(header,"P5\n%d %d\n%d\n",width,height,PIXEL_MAX);  // create header (more than 8 bit: 2 bytes per pixel)
+	fwrite(header,1, strlen(header),img);     // copy header to pgm file
+}
+
+void write_y4m_header(FILE *img, int width, int height)
+{
+	char color[16];
+
+	if (INPUT_CHROMA != CHROMA_GRAY)
+	{
+		if (PIXEL_BITS > 8) sprintf(color,"420p%d",PIXEL_BITS);
+		else strcpy(color,"420jpeg");
+	}
+	else
+	{
+		if (PIXEL_BITS > 8) sprintf(color,"mono%d",PIXEL_BITS);
+		else strcpy(color,"mono");
+	}
+	fprintf(img,"YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C%s\n",width,height,(int)(1000/FRAME_INTERVAL_MS+0.5),color);
+}
+
+void write_image(pixel img_array[H][W], FILE *img) 
+{
+	int length = fwrite(img_array,sizeof(pixel),W*H,img); // write image data to output file
+	if (length != W*H)                        // check if writing worked fine
+	{
+		fprintf(log_file,"Error writing image ==> exit.\n");
+		exit (-1);
+	}
+}
+
+static int has_suffix(const char *name, const char *suffix)
+{
+	return strlen(name) > strlen(suffix) && strcmp(name+strlen(name)-strlen(suffix),suffix) == 0;
+}
+
+// parse the header of a YUV4MPEG2 file, only the luma plane is used
+static void read_y4m_header(FILE *img, char *filename)
+{
+	char header[1024], *tag, *depth;
+	int width = 0, height = 0, bits = 8;
+
+	if (fgets(header,sizeof(header),img) == NULL || strncmp(header,"YUV4MPEG2 ",10) != 0 || strchr(header,'\n') == NULL)
+	{
+		fprintf(log_file,"%s is no YUV4MPEG2 file ==> exit.\n",filename);
+		exit(-1);
+	}
+	input.chroma = 2*(off_t)((W+1)/2)*((H+1)/2);  // default 4:2:0
+	for (tag = strtok(header+10," \n"); tag != NULL; tag = strtok(NULL," \n"))
+	{
+		switch (tag[0])
+		{
+			case 'W': width  = atoi(tag+1); break;
+			case 'H': height = atoi(tag+1); break;
+			case 'C':
+				depth = strncmp(tag+1,"mono",4) == 0 ? tag+5 : strchr(tag+1,'p');  // bits per sample, e.g. mono16, 420p10
+				if (depth != NULL && *depth == 'p') depth++;
+				if (depth != NULL && isdigit(*depth)) bits = atoi(depth);
+				if      (strncmp(tag+1,"mono",4) == 0)     input.chroma = 0;
+				else if (strncmp(tag+1,"422",3) == 0)      input.chroma = 2*(off_t)((W+1)/2)*H;
+				else if (strcmp(tag+1,"444alpha") == 0)    input.chroma = 3*(off_t)W*H;
+				else if (strncmp(tag+1,"444",3) == 0)      input.chroma = 2*(off_t)W*H;
+				else if (strncmp(tag+1,"420",3) != 0)
+				{
+					fprintf(log_file,"color space %s of %s is not supported ==> exit.\n",tag+1,filename);
+					exit(-1);
+				}
+				break;
+		}
+	}
+	if (width != W || height != H || (bits > 8) != (PIXEL_BITS > 8))
+	{
+		fprintf(log_file,"%s has %dx%d pixels with %d bit instead of %dx%d with %d bit ==> exit.\n",filename,width,height,bits,W,H,PIXEL_BITS);
+		exit(-1);
+	}
+	input.format = INPUT_Y4M;
+	input.start = ftello(img);
+	input.chroma_layout = CHROMA_GRAY;
+	if (INPUT_CHROMA != CHROMA_GRAY && input.chroma == 2*(off_t)CHROMA_PIXELS)  // 4:2:0 planes
+	{
+		input.chroma_layout = CHROMA_I420;
+	}
+	else if (INPUT_CHROMA != CHROMA_GRAY)
+	{
+		fprintf(log_file,"%s has no 4:2:0 chroma, the outputs are gray\n",filename);
+	}
+	input.chroma *= sizeof(pixel);  // more than 8 bit: 16 bit samples (little endian)
+	input.frame_size = 6 + W*H*sizeof(pixel) + input.chroma;  // "FRAME\n" (frames with parameters are not seekable)
+}
+
+static int pgm_number(FILE *img)  // next number of a PGM header (-1: none)
+{
+	int c, v = 0;
+
+	do
+	{
+		c = getc(img);
+		if (c == '#')  // comment up to the end of the line
+		{
+			while ((c = getc(img)) != '\n' && c != EOF);
+		}
+	} while (isspace(c));
+	if (!isdigit(c))
+	{
+		return -1;
+	}
+	for (; isdigit(c); c = getc(img))  // the single white space behind the number is read, too
+	{
+		v = v*10 + c - '0';
+	}
+	return v;
+}
+
+// parse the header of a binary PGM file, the frames follow it without headers (as in the outputs)
+static void read_pgm_header(FILE *img, char *filename)
+{
+	int width, height, maxval;
+
+	if (getc(img) != 'P' || getc(img) != '5')
+	{
+		fprintf(log_file,"%s is no binary PGM file ==> exit.\n",filename);
+		exit(-1);
+	}
+	width  = pgm_number(img);
+	height = pgm_number(img);
+	maxval = pgm_number(img);
+	if (width != W || height != H || maxval < 1 || maxval > PIXEL_MAX || (maxval > 255) != (PIXEL_BITS > 8))
+	{
+		fprintf(log_file,"%s has %dx%d pixels with maximum %d instead of %dx%d with %d bit ==> exit.\n",filename,width,height,maxval,W,H,PIXEL_BITS);
+		exit(-1);
+	}
+	input.start = ftello(img);
+	input.frame_size = (off_t)W*H*sizeof(pixel);
+	input.packing = 0;
+	input.big_endian = PIXEL_BITS > 8;  // 2 bytes per pixel, high byte first
+	input.chroma_layout = CHROMA_GRAY;
+}
+
+// open the input and find its frames
+FILE *open_input(char *filename)
+{
+	FILE *img = open_file(filename, "rb");
+	struct stat info;
+	int i;
+
+	fstat(fileno(img),&info);
+	if (has_suffix(filename,".ipc"))
+	{
+		input.format = INPUT_IPC;
+		input.frame_size = 0;
+		input.chroma_layout = CHROMA_GRAY;
+		input.frames = read_ipc_index(img,info.st_size,&input.index);
+		if (input.frames < 0)  // recording was not closed
+		{
+			input.frames = ipc_walk(img,info.st_size,&input.index);
+		}
+		rewind(img);
+	}
+	else if (has_suffix(filename,".y4m"))
+	{
+		read_y4m_header(img,filename);
+	}
+	else if (has_suffix(filename,".pgm"))
+	{
+		read_pgm_header(img,filename);
+	}
+	if (S_ISREG(info.st_mode) && input.frame_size > 0)
+	{
+		input.frames = (info.st_size - input.start) / input.frame_size;
+	}
+	if (input.chroma_layout == CHROMA_GRAY)  // neutral chroma for the color outputs
+	{
+		for (i=0; i < 2*CHROMA_PIXELS; i++) chroma_in[i] = 128 << PIXEL_SHIFT;
+	}
+	return img;
+}
+
+// continue reading at frame n
+int seek_frame(FILE *img, long n)
+{
+	if (n < 0 || (input.frames >= 0 && n > input.frames))
+	{
+		return 0;
+	}
+	if (input.format == INPUT_IPC)
+	{
+		return n < input.frames ? fseeko(img,input.index[n],SEEK_SET) == 0 : fseeko(img,0,SEEK_END) == 0;
+	}
+	return fseeko(img,input.start + n*input.frame_size,SEEK_SET) == 0;
+}
+
+void open_outputs()
+{
+	int i;
+
+	for (i=0; i < OUTPUTS; i++)
+	{
+		if (outputs[i].part != NULL)
+		{
+			outputs[i].file = open_file(outputs[i].part, "wb");  // frames of this process only
+		}
+		else if (strcmp(outputs[i].name,"-") == 0)
+		{
+			outputs[i].file = stdout;                      // e.g. raw grayscale video to mplayer
+		}
+		else
+		{
+			outputs[i].file = open_file(outputs[i].name, "wb");  // open/create output file
+		}
+		outputs[i].big_endian = PIXEL_BITS > 8 && has_suffix(outputs[i].name,".pgm");
+		if (outputs[i].part == NULL && has_suffix(outputs[i].name,".pgm"))
+		{
+			write_pgm_header(outputs[i].file,W>>outputs[i].level,H>>outputs[i].level);
+		}
+		if (outputs[i].part == NULL && has_suffix(outputs[i].name,".y4m"))
+		{
+			write_y4m_header(outputs[i].file,W>>outputs[i].level,H>>outputs[i].level);
+		}
+		if (has_suffix(outputs[i].name,".ipc"))
+		{
+			outputs[i].frame = malloc((W>>outputs[i].level)*(H>>outputs[i].level)*sizeof(pixel));
+			outputs[i].code = malloc(IPC_HEADER + 4*IPC_SLICES + IPC_PIXEL_BYTES*(W>>outputs[i].level)*(H>>outputs[i].level));
+			if (outputs[i].frame == NULL || outputs[i].code == NULL)
+			{
+				fprintf(log_file,"Error allocating memory ==> exit.\n");
+				exit(-1);
+			}
+		}
+	}
+}
+
+// start the output files again (the next frame overwrites the last one)
+void restart_outputs()
+{
+	int i;
+
+	for (i=0; i < OUTPUTS; i++)
+	{
+		fflush(outputs[i].file);
+		if (outputs[i].file != stdout)
+		{
+			rewind(outputs[i].file);
+		}
+		if (has_suffix(outputs[i].name,".pgm"))
+		{
+			write_pgm_header(outputs[i].file,W>>outputs[i].level,H>>outputs[i].level);
+		}
+		if (has_suffix(outputs[i].name,".y4m"))
+		{
+			write_y4m_header(outputs[i].file,W>>outputs[i].level,H>>outputs[i].level);
+		}
+		outputs[i].frames = 0;
+	}
+}
+
+void close_outputs()
+{
+	int i;
+
+	for (i=0; i < OUTPUTS; i++)
+	{
+		if (outputs[i].frame != NULL && outputs[i].part == NULL)
+		{
+			write_ipc_index(outputs[i].file,outputs[i].index,outputs[i].frames);
+		}
+		fclose(outputs[i].file);
+		free(outputs[i].frame);
+		free(outputs[i].code);
+		free(outputs[i].index);
+		free(outputs[i].part);
+		outputs[i].index = NULL;
+		outputs[i].frames = 0;
+		outputs[i].part = NULL;
+	}
+}
+
+static char *part_name(int sink, int job)
+{
+	char *name = malloc(strlen(outputs[sink].name) + 32);
+
+	if (name == NULL)
+	{
+		fprintf(log_file,"Error allocating memory ==> exit.\n");
+		exit(-1);
+	}
+	sprintf(name,"%s.part%d",strcmp(outputs[sink].name,"-") == 0 ? "stdout" : outputs[sink].name,job);
+	return name;
+}
+
+// append the parts written by the processes to the outputs (opened with open_outputs())
+void join_parts(int jobs)
+{
+	static uint8_t buffer[1<<20];
+	FILE *part;
+	off_t *offsets, base;
+	struct stat info;
+	char *name;
+	long frames, j;
+	size_t length;
+	int i, k;
+
+	for (i=0; i < OUTPUTS; i++)
+	{
+		for (k=0; k < jobs; k++)
+		{
+			name = part_name(i,k);
+			part = open_file(name, "rb");
+			if (outputs[i].frame != NULL)  // frame offsets for the index of the .ipc file
+			{
+				fstat(fileno(part),&info);
+				base = ftello(outputs[i].file);
+				offsets = NULL;
+				frames = ipc_walk(part,info.st_size,&offsets);
+				for (j=0; j < frames; j++)
+				{
+					add_offset(&outputs[i].index,&outputs[i].frames,base + offsets[j]);
+				}
+				free(offsets);
+				rewind(part);
+			}
+			while ((length = fread(buffer,1,sizeof(buffer),part)) > 0)
+			{
+				if (fwrite(buffer,1,length,outputs[i].file) != length)
+				{
+					fprintf(log_file,"Error writing image ==> exit.\n");
+					exit (-1);
+				}
+			}
+			fclose(part);
+			remove(name);
+			free(name);
+		}
+	}
+}
+
+// get the next frame: returns 1 for a new frame, 0 at the end of the input and 2 if the last image
+// is processed again with new settings (STILL_IMAGE_TUNING, the output files are overwritten)
+int next_frame(pixel img_array[H][W], FILE *img, int frames, time_t last_time)
+{
+#ifdef STILL_IMAGE_TUNING
+	static int still = 0;
+	struct stat fileInfo;
+
+	if (!still)
+	{
+		if (read_image(img_array,img))
+		{
+			return 1;
+		}
+		if (frames != 1)  // only for a single image
+		{
+			return 0;
+		}
+		still = 1;
+		fprintf(log_file,"wait for new settings (stop with Ctrl+C)\n");
+	}
+	fflush(NULL);
+	do
+	{
+		usleep(100000);
+		stat(SETTINGS_FILENAME,&fileInfo);
+	} while (fileInfo.st_mtime == last_time && !stop_requested);
+	if (stop_requested)
+	{
+		return 0;
+	}
+	restart_outputs();
+	return 2;
+#else
+	(void)frames;
+	(void)last_time;
+	return read_image(img_array,img);
+#endif
+}
+
+
+/////////////////////////////////////////////////////////////////////////////// 
+/////////////////////////////////////////////////////////////////////////////// 
+
+
+/////////////////////////////////////////////////////////////////////////////// 
+// image processing funtions
+/////////////////////////////////////////////////////////////////////////////// 
+
+#define LANES  (8/(int)sizeof(pixel))  // pixels in 64 bits (8 with 8 bit, 4 with more)
+
+static inline uint64_t load8(const void *p)
+{
+	uint64_t v;
+	memcpy(&v,p,8);  // unaligned load of 8 bytes (LANES pixels)
+	return v;
+}
+
+static inline void store8(void *p, uint64_t v)
+{
+	memcpy(p,&v,8);  // unaligned store of 8 bytes
+}
+
+static inline uint64_t reverse_lanes(uint64_t v)  // pixels of 64 bits in reversed order
+{
+	v = __builtin_bswap64(v);
+	if (sizeof(pixel) == 2)  // the bytes of each 16 bit pixel back in order
+	{
+		v = (v >> 8 & 0x00FF00FF00FF00FFull) | (v & 0x00FF00FF00FF00FFull) << 8;
+	}
+	return v;
+}
+
+// copy n pixels in reversed order (LANES pixels at once with a byte swap)
+static void reverse_line(pixel *out, const pixel *in, int n)
+{
+	int x;
+
+	for (x=0; x+LANES <= n; x+=LANES)
+	{
+		store8(&out[x], reverse_lanes(load8(&in[n-LANES-x])));
+	}
+	for (; x < n; x++) // remaining pixels
+	{
+		out[x] = in[n-1-x];
+	}
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// image views
+// a view describes an image by a pointer and strides instead of copying it:
+// flips, crops and integer zoom only change the view, the next stage reads through it
+///////////////////////////////////////////////////////////////////////////////
+
+typedef struct
+{
+	pixel *base;       // address of the top left pixel of the view
+	int width, height; // size of the view
+	int line_stride;   // distance between two lines (negative: flipped vertically)
+	int pixel_stride;  // distance between two pixels (negative: flipped horizontally)
+	int zoom;          // integer zoom: pixel (x,y) of the view is source pixel (x/zoom, y/zoom)
+} img_view;
+
+img_view view_image(pixel img[H][W])
+{
+	img_view v = { &img[0][0], W, H, W, 1, 1 };
+	return v;
+}
+
+img_view view_buffer(pixel *img, int width, int height) // image with a different size than the frame
+{
+	img_view v = { img, width, height, width, 1, 1 };
+	return v;
+}
+
+int view_is_image(img_view v) // view is identical to the memory layout of a complete frame
+{
+	return v.width == W && v.height == H && v.line_stride == W && v.pixel_stride == 1 && v.zoom == 1;
+}
+
+img_view view_crop(img_view v, int x, int y, int width, int height) // region of interest (for zoom == 1)
+{
+	v.base += y*v.line_stride + x*v.pixel_stride;
+	v.width = width;
+	v.height = height;
+	return v;
+}
+
+img_view view_flip_horizontal(img_view v)
+{
+	v.base += (v.width/v.zoom - 1)*v.pixel_stride;
+	v.pixel_stride = -v.pixel_stride;
+	return v;
+}
+
+img_view view_flip_vertical(img_view v)
+{
+	v.base += (v.height/v.zoom - 1)*v.line_stride;
+	v.line_stride = -v.line_stride;
+	return v;
+}
+
+// same result as zoom(): crop the center of the image and enlarge it by pixel replication
+img_view view_zoom(img_view v, int faktor)
+{
+	int hf = v.height/faktor;
+	int wf = v.width/faktor;
+
+	v = view_crop(v, (faktor-1)*(wf>>1), (faktor-1)*(hf>>1), wf, hf);
+	v.width = wf*faktor;
+	v.height = hf*faktor;
+	v.zoom = faktor;
+	return v;
+}
+
+img_view view_scale(img_view v, int faktor) // enlarge by pixel replication (result must fit into a frame)
+{
+	v.width *= faktor;
+	v.height *= faktor;
+	v.zoom *= faktor;
+	return v;
+}
+
+// read line y of the view into a line of the frame (W pixels), pixels outside of the view are set to 0
+void view_line(pixel *out, img_view v, int y)
+{
+	const pixel *in;
+	int x,z;
+
+	if (y >= v.height)
+	{
+		memset(out,0,W*sizeof(pixel));
+		return;
+	}
+	in = v.base + (y/v.zoom)*v.line_stride;
+
+	if (v.zoom == 1)
+	{
+		if (v.pixel_stride == 1)
+		{
+			memcpy(out,in,v.width*sizeof(pixel));
+		}
+		else if (v.pixel_stride == -1)
+		{
+			reverse_line(out,in-(v.width-1),v.width);  // SIMD byte reverse
+		}
+		else
+		{
+			for (x=0; x < v.width; x++) out[x] = in[x*v.pixel_stride];
+		}
+	}
+	else
+	{
+		for (x=0; x < v.width/v.zoom; x++)  // replicate every source pixel
+		{
+			for (z=0; z < v.zoom; z++)
+			{
+				out[x*v.zoom+z] = in[x*v.pixel_stride];
+			}
+		}
+	}
+	memset(&out[v.width],0,(W-v.width)*sizeof(pixel));
+}
+
+void view_to_image(pixel out[H][W], img_view v) // materialize a view
+{
+	int y;
+
+	for (y=0; y < H; y++)  // loop over all lines
+	{
+		if (y > 0 && y < v.height && y % v.zoom != 0)
+		{
+			memcpy(out[y],out[y-1],sizeof(out[y]));  // same source line as before
+		}
+		else
+		{
+			view_line(out[y],v,y);
+		}
+	}
+}
+
+static void write_line(const pixel *line, int n, int level, int y)  // to all sinks of a pyramid level
+{
+	uint16_t swapped[W];
+	int i, x;
+
+	for (i=0; i < OUTPUTS; i++)
+	{
+		if (outputs[i].level != level) continue;
+		if (outputs[i].frame != NULL)
+		{
+			memcpy(outputs[i].frame + y*n,line,n*sizeof(pixel));  // compressed when the frame is complete
+		}
+		else if (outputs[i].big_endian)  // 16 bit PGM
+		{
+			for (x=0; x < n; x++)
+			{
+				swapped[x] = __builtin_bswap16(line[x]);
+			}
+			if (fwrite(swapped,2,n,outputs[i].file) != (size_t)n)
+			{
+				fprintf(log_file,"Error writing image ==> exit.\n");
+				exit (-1);
+			}
+		}
+		else if (fwrite(line,sizeof(pixel),n,outputs[i].file) != (size_t)n)
+		{
+			fprintf(log_file,"Error writing image ==> exit.\n");
+			exit (-1);
+		}
+	}
+}
+
+void begin_outputs()  // before the lines of a frame
+{
+	int i;
+
+	for (i=0; i < OUTPUTS; i++)
+	{
+		if (has_suffix(outputs[i].name,".y4m"))
+		{
+			fputs("FRAME\n",outputs[i].file);
+		}
+	}
+}
+
+// write the lines y0 <= y < y1 of the image seen through a view without materializing it to all outputs,
+// the lines of the smaller pyramid levels are added up while the line is in the cache
+void write_output_lines(img_view v, int y0, int y1)
+{
+	static STREAM_LOCAL pixel_sum sum[MAX_LEVEL+1][W];  // sums of 2^l lines, W>>l columns each
+	pixel line[W];
+	const pixel *p;
+	int x,y,i,l,levels = 0;
+
+	for (i=0; i < OUTPUTS; i++)
+	{
+		levels |= 1 << outputs[i].level;
+	}
+	for (y=y0; y < y1; y++)  // loop over the lines
+	{
+		if (view_is_image(v))
+		{
+			p = v.base + y*W;
+		}
+		else
+		{
+			view_line(line,v,y);
+			p = line;
+		}
+		if (levels & 1)
+		{
+			write_line(p,W,0,y);
+		}
+		for (l=1; l <= MAX_LEVEL; l++)
+		{
+			if (!(levels & (1<<l))) continue;
+			for (x=0; x < (W>>l)<<l; x++)
+			{
+				sum[l][x>>l] += p[x];
+			}
+			if (((y+1) & ((1<<l)-1)) == 0)  // 2^l lines complete: box binning with rounding
+			{
+				for (x=0; x < W>>l; x++)
+				{
+					line[x] = (sum[l][x] + (1<<(2*l-1))) >> (2*l);
+				}
+				memset(sum[l],0,(W>>l)*sizeof(sum[l][0]));
+				write_line(line,W>>l,l,y>>l);
+			}
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// chroma of color video
+// the chroma of a frame is written behind the luma plane of the raw and .y4m outputs, geometric stages
+// move it with a table that holds the source of every chroma pixel (see plan_chroma())
+///////////////////////////////////////////////////////////////////////////////
+
+STREAM_LOCAL int32_t chroma_map[CHROMA_PIXELS];  // source of every chroma pixel (-1: none, neutral)
+STREAM_LOCAL int chroma_moved = 0;              // the plan has geometric stages, chroma_map is used
+
+// index of component k (0: U, 1: V) of chroma pixel p, n pixels per component
+static inline int chroma_index(int layout, int k, int p, int n)
+{
+	return layout == CHROMA_NV12 ? 2*p + k : k*n + p;
+}
+
+// chroma of pyramid level l in the given layout, binned like the luma (returns in if it is the same)
+static const pixel *chroma_level(const pixel *in, int layout_in, pixel *out, int layout, int l)
+{
+	int cw = (W>>l)/2, ch = (H>>l)/2;
+	int k, x, y, i, j;
+	unsigned int sum;
+
+	if (l == 0 && layout == layout_in)
+	{
+		return in;
+	}
+	for (k=0; k < 2; k++)
+	{
+		for (y=0; y < ch; y++)
+		{
+			for (x=0; x < cw; x++)
+			{
+				sum = 0;
+				for (j=0; j < 1<<l; j++)
+				{
+					for (i=0; i < 1<<l; i++)
+					{
+						sum += in[chroma_index(layout_in,k,((y<<l)+j)*(W/2) + (x<<l)+i,CHROMA_PIXELS)];
+					}
+				}
+				out[chroma_index(layout,k,y*cw+x,cw*ch)] = (sum + ((1<<(2*l))>>1)) >> (2*l);
+			}
+		}
+	}
+	return out;
+}
+
+static void write_chroma()  // after the luma plane of a frame
+{
+	static STREAM_LOCAL pixel moved[2*CHROMA_PIXELS], binned[2*CHROMA_PIXELS];
+	int layout_in = input.chroma_layout != CHROMA_GRAY ? input.chroma_layout : INPUT_CHROMA;  // neutral: any
+	const pixel *c = chroma_in, *p;
+	int i, k, q, size;
+
+	if (chroma_moved)
+	{
+		#pragma omp parallel for private(k)
+		for (q=0; q < CHROMA_PIXELS; q++)
+		{
+			for (k=0; k < 2; k++)
+			{
+				moved[chroma_index(layout_in,k,q,CHROMA_PIXELS)] =
+					chroma_map[q] < 0 ? 128 << PIXEL_SHIFT : chroma_in[chroma_index(layout_in,k,chroma_map[q],CHROMA_PIXELS)];
+			}
+		}
+		c = moved;
+	}
+	for (i=0; i < OUTPUTS; i++)
+	{
+		if (outputs[i].frame != NULL || has_suffix(outputs[i].name,".pgm")) continue;  // luma only
+		p = chroma_level(c,layout_in,binned,has_suffix(outputs[i].name,".y4m") ? CHROMA_I420 : INPUT_CHROMA,outputs[i].level);
+		size = 2*((W>>outputs[i].level)/2)*((H>>outputs[i].level)/2);
+		if (fwrite(p,sizeof(pixel),size,outputs[i].file) != (size_t)size)
+		{
+			fprintf(log_file,"Error writing image ==> exit.\n");
+			exit (-1);
+		}
+	}
+}
+
+void end_outputs()  // after the lines of a frame: chroma and compressed outputs
+{
+	int i;
+
+	if (INPUT_CHROMA != CHROMA_GRAY)
+	{
+		write_chroma();
+	}
+	for (i=0; i < OUTPUTS; i++)
+	{
+		if (outputs[i].frame != NULL)
+		{
+			size_t size = ipc_encode(outputs[i].code,outputs[i].frame,W>>outputs[i].level,H>>outputs[i].level);
+			add_offset(&outputs[i].index,&outputs[i].frames,ftello(outputs[i].file));
+			if (fwrite(outputs[i].code,1,size,outputs[i].file) != size)
+			{
+				fprintf(log_file,"Error writing image ==> exit.\n");
+				exit (-1);
+			}
+		}
+	}
+}
+
+void write_outputs(img_view v)  // a complete frame
+{
+	begin_outputs();
+	write_output_lines(v,0,H);
+	end_outputs();
+}
+
+// filter the pixels x0 <= x < x1, y0 <= y < y1 (border pixels without complete window are skipped),
+// param are the parameters of the stage (the FIR and median filter have none)
+void fir_filter_region(int width, int height, pixel out[height][width], pixel in[height][width], int x0, int y0, int x1, int y1, const int param[])
+{
+	int k,l,x,y;
+	int sum;
+	
+	(void)param;  // the FIR filter has no parameters
+	if (y0 < (K>>1)) y0 = K>>1;
+	if (x0 < (K>>1)) x0 = K>>1;
+	if (y1 > height-(K>>1)) y1 = height-(K>>1);
+	if (x1 > width-(K>>1)) x1 = width-(K>>1);
+	
+	for (y=y0; y < y1; y++)  // loop over all lines of region
+	{
+		for (x=x0; x < x1; x++)  // loop over all rows of region
+		{
+			// perform FIR filtering for each output pixel
+			sum = 0;	
+			for (k=0; k< K; k++)   // loop over all lines of filter window
+			{
+				for (l=0; l< K; l++) // loop over all rows of filter window
+				{
+					sum += c[k][l] * in[y-(K>>1)+k][x-(K>>1)+l];  // process each pixel in window
+					
+				}
+				
+			
+			}
+			sum = sum/g + h*(1<<PIXEL_SHIFT);  // scaling and offset (8 bit scale)
+
+			if (sum < 0) sum = 0; //clipping
+			else if (sum > PIXEL_MAX) sum=PIXEL_MAX;  
+			
+			out[y][x] = sum;  // write to output
+		}
+	}
+}
+
+void fir_filter(int width, int height, pixel out[height][width], pixel in[height][width])
+{
+	fir_filter_region(width,height,out,in,0,0,width,height,NULL);
+}
+
+void flip_horizontal(pixel out[H][W], pixel in[H][W]) // spiegeln
+{
+	int y;
+	
+	for (y=0; y < H; y++)  // loop over all lines
+	{
+		reverse_line(out[y],in[y],W);  // Optimierung: LANES Pixel auf einmal per Byte-Swap
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// brightness change and exposure control
+// the brightness change is a lookup table, the same pass collects the histogram of its input,
+// the statistics of one frame set the table of the next frame (auto brightness/contrast);
+// the table has an entry per pixel value, the histograms and statistics are on the 8 bit scale
+///////////////////////////////////////////////////////////////////////////////
+
+#define EXPOSURE_TARGET    128   // desired mean value for auto brightness
+#define EXPOSURE_SMOOTHING 0.25  // weight of the newest frame for the automatic modes (avoids flicker)
+#define EXPOSURE_CLIP      0.01  // fraction of dark and bright pixels ignored by auto contrast
+
+enum { EXPOSURE_MANUAL, EXPOSURE_AUTO_BRIGHTNESS, EXPOSURE_AUTO_CONTRAST, EXPOSURE_EQUALIZE };
+
+typedef struct
+{
+	uint32_t hist[256]; // histogram of the input of the brightness change (pixel >> PIXEL_SHIFT)
+	uint32_t count;     // number of pixels in the histogram
+	double mean;
+	int low, high;      // percentiles at EXPOSURE_CLIP and 1-EXPOSURE_CLIP
+} img_stats;
+
+typedef struct
+{
+	int mode;          // EXPOSURE_...
+	int valid;         // statistics of a previous frame are available
+	double offset;     // smoothed offset of auto brightness
+	double low, high;  // smoothed range of auto contrast
+	uint32_t cdf[256]; // cumulative histogram of the last frame for the equalization
+	uint32_t count;
+} exposure_ctrl;
+
+// lookup table for the brightness change, the histogram is counted in 4 sub-histograms
+// (neighbouring pixels often have the same value, this avoids waiting for the previous increment)
+static void brightness_line(pixel *out, const pixel *in, int n, const pixel lut[PIXEL_MAX+1], uint32_t sub[4][256], int count)
+{
+	int x;
+
+	if (count <= 0)
+	{
+		for (x=0; x < n; x++) out[x] = lut[in[x]];
+		return;
+	}
+	for (x=0; x+4 <= count; x+=4)  // 4-fach Loop-Unrolling
+	{
+		int a = in[x], b = in[x+1], c = in[x+2], d = in[x+3];
+		sub[0][a>>PIXEL_SHIFT]++; sub[1][b>>PIXEL_SHIFT]++; sub[2][c>>PIXEL_SHIFT]++; sub[3][d>>PIXEL_SHIFT]++;
+		out[x] = lut[a]; out[x+1] = lut[b]; out[x+2] = lut[c]; out[x+3] = lut[d];
+	}
+	for (; x < count; x++)
+	{
+		sub[0][in[x]>>PIXEL_SHIFT]++;
+		out[x] = lut[in[x]];
+	}
+	for (; x < n; x++)  // pixels outside of the view are not counted
+	{
+		out[x] = lut[in[x]];
+	}
+}
+
+void finish_stats(img_stats *stats)  // mean and percentiles of the histogram
+{
+	uint64_t sum = 0;
+	uint32_t acc = 0;
+	int v;
+
+	stats->count = 0;
+	for (v=0; v < 256; v++)
+	{
+		stats->count += stats->hist[v];
+		sum += (uint64_t)v*stats->hist[v];
+	}
+	stats->mean = stats->count ? (double)sum/stats->count : 0;
+	stats->low = 0;
+	stats->high = 255;
+	for (v=0; v < 256; v++)
+	{
+		acc += stats->hist[v];
+		if (acc <= EXPOSURE_CLIP*stats->count) stats->low = v+1;
+		if (acc < (1-EXPOSURE_CLIP)*stats->count) stats->high = v+1;
+	}
+	if (stats->low > stats->high) stats->low = stats->high;
+}
+
+// reads the input through a view, so a preceding zoom or flip costs no extra pass,
+// stats (may be NULL) receives the histogram, mean and percentiles of the view
+void change_brightness(pixel out[H][W], img_view in, const pixel lut[PIXEL_MAX+1], img_stats *stats)
+{
+	int y;
+
+	if (stats != NULL)
+	{
+		memset(stats,0,sizeof(*stats));
+	}
+
+	#pragma omp parallel  // every thread has its own histograms, they are added at the end
+	{
+		uint32_t sub[4][256];
+		int j,v;
+
+		memset(sub,0,sizeof(sub));
+
+		#pragma omp for schedule(static)
+		for (y=0; y < H; y+=in.zoom)  // loop over groups of lines with the same source line
+		{
+			int count = (stats != NULL && y < in.height) ? in.width : 0;
+
+			if (in.pixel_stride == 1 && in.zoom == 1 && in.width == W && y < in.height)
+			{
+				brightness_line(out[y],in.base + y*in.line_stride,W,lut,sub,count);
+			}
+			else
+			{
+				view_line(out[y],in,y);
+				brightness_line(out[y],out[y],W,lut,sub,count);
+			}
+			for (j=1; j < in.zoom && y+j < H; j++)
+			{
+				memcpy(out[y+j],out[y],sizeof(out[y]));  // same source line
+			}
+		}
+
+		if (stats != NULL)
+		{
+			#pragma omp critical
+			for (v=0; v < 256; v++)
+			{
+				stats->hist[v] += sub[0][v] + sub[1][v] + sub[2][v] + sub[3][v];
+			}
+		}
+	}
+
+	if (stats != NULL)
+	{
+		finish_stats(stats);
+	}
+}
+
+// table for the next frame: automatic correction from the last statistics plus the manual offset c
+void exposure_lut(pixel lut[PIXEL_MAX+1], const exposure_ctrl *e, int c)
+{
+	int v;
+	double u, temp;
+
+	for (v=0; v <= PIXEL_MAX; v++)
+	{
+		u = (double)v/(1<<PIXEL_SHIFT);  // 8 bit scale
+		temp = u;
+		if (e->valid)
+		{
+			switch (e->mode)
+			{
+				case EXPOSURE_AUTO_BRIGHTNESS:
+					temp = u + e->offset;
+					break;
+				case EXPOSURE_AUTO_CONTRAST:
+					temp = (u - e->low)*255.0/(e->high - e->low > 1 ? e->high - e->low : 1);
+					break;
+				case EXPOSURE_EQUALIZE:
+					temp = e->count ? (double)e->cdf[v>>PIXEL_SHIFT]*255/e->count : u;
+					break;
+			}
+		}
+		temp = temp*(1<<PIXEL_SHIFT) + (c*(1<<PIXEL_SHIFT) + 0.5);
+		if (temp > 0)
+		{
+			if (temp < PIXEL_MAX)
+			{
+				lut[v] = temp;
+			}
+			else
+			{
+				lut[v] = PIXEL_MAX;
+			}
+		}
+		else
+		{
+			lut[v] = 0;
+		}
+	}
+}
+
+void exposure_update(exposure_ctrl *e, const img_stats *s)
+{
+	double k = e->valid ? EXPOSURE_SMOOTHING : 1;  // the first frame sets the start values
+	uint32_t acc = 0;
+	int v;
+
+	if (s->count == 0)
+	{
+		return;
+	}
+	e->offset += k*((EXPOSURE_TARGET - s->mean) - e->offset);
+	e->low    += k*(s->low - e->low);
+	e->high   += k*(s->high - e->high);
+	for (v=0; v < 256; v++)
+	{
+		acc += s->hist[v];
+		e->cdf[v] = acc;
+	}
+	e->count = acc;
+	e->valid = 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// temporal denoising (stage "temporal")
+// recursive filter: every pixel moves from the frame towards the previous result with a weight from a table of
+// the difference between the two (8 bit scale), small differences are noise and get the full strength, large ones
+// are motion and keep the new pixel, so moving parts are not smeared; the previous result is the only history
+///////////////////////////////////////////////////////////////////////////////
+
+#define TEMPORAL_BITS 8  // fixed point of the weights (1 << TEMPORAL_BITS: the previous result only)
+
+STREAM_LOCAL pixel history[H][W];    // result of the temporal stage for the last frame
+STREAM_LOCAL uint32_t history_key;   // plan and stages in front of it that computed history (0: none)
+STREAM_LOCAL uint32_t history_runs;  // frames filtered, changes the cache keys of the following stages
+
+// weights of the previous result for the differences 0..255: param[0] percent up to param[1] (noise level),
+// decreasing to 0 at three times the noise level
+void temporal_weights(uint16_t weight[256], const int param[])
+{
+	int strength = (param[0] < 100 ? param[0] : 100) * (1<<TEMPORAL_BITS) / 100;
+	int noise = param[1] > 0 ? param[1] : 1;
+	int d;
+
+	for (d=0; d < 256; d++)
+	{
+		weight[d] = d <= noise ? strength : d >= 3*noise ? 0 : strength * (3*noise - d) / (2*noise);
+	}
+}
+
+// out = in + w*(out - in) with the previous result in out and the weight w of |out - in|
+static void temporal_line(pixel *out, const pixel *in, int n, const uint16_t weight[256])
+{
+	int x, d;
+
+	for (x=0; x < n; x++)
+	{
+		d = out[x] - in[x];
+		out[x] = in[x] + ((d*weight[(d < 0 ? -d : d) >> PIXEL_SHIFT] + (1<<(TEMPORAL_BITS-1))) >> TEMPORAL_BITS);
+	}
+}
+
+// reads the input through a view like change_brightness(), without a valid history the frame is copied
+void temporal_filter(img_view in, const uint16_t weight[256], int valid)
+{
+	int y;
+
+	#pragma omp parallel for schedule(static)
+	for (y=0; y < H; y++)
+	{
+		pixel line[W];
+		const pixel *p = line;
+
+		if (in.pixel_stride == 1 && in.zoom == 1 && in.width == W && y < in.height)
+		{
+			p = in.base + y*in.line_stride;
+		}
+		else
+		{
+			view_line(line,in,y);
+		}
+		if (valid)
+		{
+			temporal_line(history[y],p,W,weight);
+		}
+		else
+		{
+			memcpy(history[y],p,sizeof(history[y]));
+		}
+	}
+}
+
+void array_copy(pixel out[H][W], pixel in[H][W])
+{
+	int x,y;
+	
+	for (y=0; y < H; y++)  // loop over all lines
+	{
+		for (x=0; x < W; x++)  // loop over all rows
+		{
+			out[y][x] = in[y][x];  // process each pixel
+		}
+		
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// rotation by multiples of 90 degree
+// the mapping is exact, so there is no need for sin/cos per pixel:
+// 180 degree is a copy of reversed lines, 90/270 degree is a transposition
+///////////////////////////////////////////////////////////////////////////////
+
+#define ROT_BLOCK 64  // size of the cache blocks for the transposition (multiple of 8)
+
+// transpose a 8x8 block of pixels kept in 8 registers (byte i of r[k] is pixel k,i)
+// by swapping elements of 1, 2 and 4 bytes, little endian byte order is assumed (ARM, x86)
+#define SWAP_ELEMENTS(a,b,shift,mask) \
+	t = ((a >> shift) ^ b) & mask;    \
+	b ^= t;                           \
+	a ^= t << shift;
+
+static inline void transpose8x8(uint64_t r[8])
+{
+	uint64_t t;
+
+	SWAP_ELEMENTS(r[0],r[1], 8,0x00FF00FF00FF00FFULL)
+	SWAP_ELEMENTS(r[2],r[3], 8,0x00FF00FF00FF00FFULL)
+	SWAP_ELEMENTS(r[4],r[5], 8,0x00FF00FF00FF00FFULL)
+	SWAP_ELEMENTS(r[6],r[7], 8,0x00FF00FF00FF00FFULL)
+
+	SWAP_ELEMENTS(r[0],r[2],16,0x0000FFFF0000FFFFULL)
+	SWAP_ELEMENTS(r[1],r[3],16,0x0000FFFF0000FFFFULL)
+	SWAP_ELEMENTS(r[4],r[6],16,0x0000FFFF0000FFFFULL)
+	SWAP_ELEMENTS(r[5],r[7],16,0x0000FFFF0000FFFFULL)
+
+	SWAP_ELEMENTS(r[0],r[4],32,0x00000000FFFFFFFFULL)
+	SWAP_ELEMENTS(r[1],r[5],32,0x00000000FFFFFFFFULL)
+	SWAP_ELEMENTS(r[2],r[6],32,0x00000000FFFFFFFFULL)
+	SWAP_ELEMENTS(r[3],r[7],32,0x00000000FFFFFFFFULL)
+}
+
+// the same for a 4x4 block of 16 bit pixels (more than 8 bit), swapping elements of 2 and 4 bytes
+static inline void transpose4x4(uint64_t r[4])
+{
+	uint64_t t;
+
+	SWAP_ELEMENTS(r[0],r[1],16,0x0000FFFF0000FFFFULL)
+	SWAP_ELEMENTS(r[2],r[3],16,0x0000FFFF0000FFFFULL)
+
+	SWAP_ELEMENTS(r[0],r[2],32,0x00000000FFFFFFFFULL)
+	SWAP_ELEMENTS(r[1],r[3],32,0x00000000FFFFFFFFULL)
+}
+
+static inline void transpose_lanes(uint64_t r[LANES])  // LANES x LANES pixels
+{
+	if (LANES == 8) transpose8x8(r);
+	else transpose4x4(r);
+}
+
+void rotation_180(pixel out[H][W], pixel in[H][W])
+{
+	int y;
+
+	for (y=0; y < H; y++)  // loop over all lines
+	{
+		reverse_line(out[y], in[H-1-y], W);
+	}
+}
+
+// 90 degree:  out[y][x] = in[c-x][y+d]
+// 270 degree: out[y][x] = in[x-d][c-y]
+// with d = (W-H)/2 and c = d+H-1, pixels without source are set to 0
+void rotation_90(pixel out[H][W], pixel in[H][W], int angle_grad)
+{
+	int d = (W-H)/2;
+	int c = d+H-1;
+	int x0 = d > 0 ? d : 0;                 // range of output rows and columns with source pixels
+	int x1 = d+H < W ? d+H : W;
+	int y0 = angle_grad == 270 ? (d+H-W > 0 ? d+H-W : 0) : (-d > 0 ? -d : 0);
+	int y1 = angle_grad == 270 ? (d+H < H ? d+H : H) : (W-d < H ? W-d : H);
+	int bx,by,tx,ty,x,y,j;
+	uint64_t r[8];
+
+	for (y=0; y < H; y++)  // clear the parts without source pixels
+	{
+		if (y < y0 || y >= y1)
+		{
+			memset(out[y],0,sizeof(out[y]));
+		}
+		else
+		{
+			memset(out[y],0,x0*sizeof(pixel));
+			memset(&out[y][x1],0,(W-x1)*sizeof(pixel));
+		}
+	}
+
+	for (by=y0; by < y1; by+=ROT_BLOCK)  // loop over cache blocks
+	{
+		for (bx=x0; bx < x1; bx+=ROT_BLOCK)
+		{
+			for (ty=by; ty < by+ROT_BLOCK && ty < y1; ty+=LANES)  // loop over LANES x LANES tiles
+			{
+				for (tx=bx; tx < bx+ROT_BLOCK && tx < x1; tx+=LANES)
+				{
+					if (ty+LANES <= y1 && tx+LANES <= x1)
+					{
+						if (angle_grad == 90)
+						{
+							for (j=0; j<LANES; j++) r[j] = load8(&in[c-tx-j][ty+d]);  // line j of the tile is column tx+j of the output
+							transpose_lanes(r);
+							for (j=0; j<LANES; j++) store8(&out[ty+j][tx], r[j]);
+						}
+						else
+						{
+							for (j=0; j<LANES; j++) r[j] = load8(&in[tx+j-d][c-ty-(LANES-1)]);
+							transpose_lanes(r);
+							for (j=0; j<LANES; j++) store8(&out[ty+j][tx], r[LANES-1-j]);
+						}
+					}
+					else  // incomplete tile at the border
+					{
+						for (y=ty; y < ty+LANES && y < y1; y++)
+						{
+							for (x=tx; x < tx+LANES && x < x1; x++)
+							{
+								out[y][x] = angle_grad == 90 ? in[c-x][y+d] : in[x-d][c-y];
+							}
+						}
+					}
+				}
+			}
+		}
+	}
+}
+
+//Quelle: http://homepages.inf.ed.ac.uk/rbf/BOOKS/PHILLIPS/
+void rotation(pixel out[H][W], pixel in[H][W],int angle_grad)
+{
+	int x,y,x_out,y_out;
+	int temp;
+	double c,s;
+
+	switch (((angle_grad % 360) + 360) % 360)  // fast paths for multiples of 90 degree
+	{
+		case 0:   array_copy(out,in); return;
+		case 90:  rotation_90(out,in,90); return;
+		case 180: rotation_180(out,in); return;
+		case 270: rotation_90(out,in,270); return;
+	}
+
+	double angle_rad = (double)angle_grad*3.14159265359/180;
+	c = cos(angle_rad);
+	s = sin(angle_rad);
+	double center_x = (double)W/2;
+	double center_y = (double)H/2;
+	
+	for (y=0; y < H; y++)  // loop over all lines
+	{
+		for (x=0; x < W; x++)  // loop over all rows
+		{
+			x_out = center_x + ((double)(y)-center_y)*s+((double)(x)-center_x)*c;
+			y_out = center_y + ((double)(y)-center_y)*c-((double)(x)-center_x)*s;
+			
+			temp = 0; //in case the original pixel is not available
+			if(x_out >= 0 && x_out < W && y_out >= 0 && y_out < H)
+			{
+				 temp = in[y_out][x_out];
+			}
+			out[y][x] = temp;
+		}
+	}
+}
+
+//Quelle: http://homepages.inf.ed.ac.uk/rbf/BOOKS/PHILLIPS/
+void zoom(pixel out[H][W], pixel in[H][W], int faktor)
+{
+	view_to_image(out,view_zoom(view_image(in),faktor));  // Optimierung: nur ein Durchlauf statt faktor*faktor
+}
+
+
+
+// filter the pixels x0 <= x < x1, y0 <= y < y1 (border pixels without complete window are skipped),
+// param are the parameters of the stage (the FIR and median filter have none)
+void median_filter_region(int width, int height, pixel out[height][width], pixel in[height][width], int x0, int y0, int x1, int y1, const int param[])
+{
+	int s = 3; //size of filter window
+	int ds=s>>1;
+	int x,y, j, k ;
+	int window[9]; // Declare the chosen 3x3 Pixels
+	int tmp;
+	
+	(void)param;  // the median filter has no parameters
+	if (y0 < ds) y0 = ds;
+	if (x0 < ds) x0 = ds;
+	if (y1 > height-ds) y1 = height-ds;
+	if (x1 > width-ds) x1 = width-ds;
+	
+	for (y=y0; y < y1; y ++)  // loop over all lines of region
+	{
+		for (x=x0; x < x1; x ++)  // loop over all rows of region
+		{
+			// 3x3 will be taken
+			window[0] = in[y-1][x-1];
+			window[1] = in[y-1][x];
+			window[2] = in[y-1][x+1];
+		  
+			window[3] = in[y][x-1];
+			window[4] = in[y][x];
+			window[5] = in[y][x+1];
+		 
+			window[6] = in[y+1][x-1];
+			window[7] = in[y+1][x];
+			window[8] = in[y+1][x+1];
+			
+			// Sort-Algorithm: the chosen 3x3 Pixels will be sort
+			for ( j = 0; j < 9; j ++)			  
+		    {  
+			    for( k = j+1; k< 9 ; k ++)			   
+				{
+					if( window[j] < window[k])			      
+					{
+						tmp = window[j];
+						window[j]=window[k];
+						window[k]=tmp;
+   
+					}
+			    }
+			}
+			 
+			out[y][x] = window[4];
+			 	    
+		}
+	}
+}
+
+void median_filter(int width, int height, pixel out[height][width], pixel in[height][width])
+{
+	median_filter_region(width,height,out,in,0,0,width,height,NULL);
+}
+
+static inline int clamp_int(int v, int low, int high)
+{
+	return v < low ? low : v > high ? high : v;
+}
+
+int box_radius(int radius)
+{
+	return clamp_int(radius,0,BOX_MAX_RADIUS);
+}
+
+// sums of the windows x-r ... x+r of one line for x0 <= x < x1 (running sum, pixels outside are the edge pixels)
+static void box_line(pixel_sum *sum, const pixel *in, int width, int x0, int x1, int r)
+{
+	unsigned int s = 0;
+	int x;
+
+	for (x=x0-r; x <= x0+r; x++)
+	{
+		s += in[clamp_int(x,0,width-1)];
+	}
+	sum[0] = s;
+	for (x=x0+1; x < x1; x++)  // one pixel enters and one leaves the window
+	{
+		s += in[clamp_int(x+r,0,width-1)] - in[clamp_int(x-r-1,0,width-1)];
+		sum[x-x0] = s;
+	}
+}
+
+// box blur of the pixels x0 <= x < x1, y0 <= y < y1 with the window (2*param[0]+1)^2,
+// the separable running sums make the cost per pixel independent of the window size,
+// at the border the edge pixels are repeated (a large window would leave a wide border otherwise)
+void box_filter_region(int width, int height, pixel out[height][width], pixel in[height][width], int x0, int y0, int x1, int y1, const int param[])
+{
+	static STREAM_LOCAL pixel_sum rows[2*BOX_MAX_RADIUS+1][W];  // sums of the lines in the window (ring buffer, one per thread)
+	uint32_t col[W];                               // sums of the window
+	int r = box_radius(param[0]);
+	int n = 2*r+1;
+	uint64_t inv = ((1ull<<32) + n*n-1)/(n*n);    // division by multiplication (exact for the sums of 8 bit pixels)
+	int x,y,k,slot;
+
+	x0 = clamp_int(x0,0,width);
+	y0 = clamp_int(y0,0,height);
+	x1 = clamp_int(x1,0,width);
+	y1 = clamp_int(y1,0,height);
+	if (x0 >= x1 || y0 >= y1)
+	{
+		return;
+	}
+
+	memset(col,0,(x1-x0)*sizeof(col[0]));
+	for (k=0; k < n; k++)  // first window: lines y0-r ... y0+r
+	{
+		box_line(rows[k],in[clamp_int(y0-r+k,0,height-1)],width,x0,x1,r);
+		for (x=0; x < x1-x0; x++) col[x] += rows[k][x];
+	}
+	for (y=y0; y < y1; y++)  // loop over all lines of region
+	{
+		if (y > y0)  // line y-r-1 leaves the window, line y+r enters
+		{
+			slot = (y-y0-1) % n;
+			for (x=0; x < x1-x0; x++) col[x] -= rows[slot][x];
+			box_line(rows[slot],in[clamp_int(y+r,0,height-1)],width,x0,x1,r);
+			for (x=0; x < x1-x0; x++) col[x] += rows[slot][x];
+		}
+		for (x=0; x < x1-x0; x++)  // loop over all rows of region
+		{
+			out[y][x0+x] = PIXEL_BITS > 8 ? (col[x] + n*n/2)/(n*n) : ((col[x] + n*n/2)*inv) >> 32;
+		}
+	}
+}
+
+// radii of the box blurs whose repeated application approximates a gaussian with sigma = param[0]
+// (param[1] passes, widths after Kovesi), returns the sum of the radii (halo)
+int gauss_radii(const int param[], int radius[GAUSS_MAX_PASSES])
+{
+	double var = 12.0*param[0]*param[0];
+	int n = clamp_int(param[1],1,GAUSS_MAX_PASSES);
+	int wl = (int)sqrt(var/n + 1);  // width of the smaller boxes
+	int m, i, r, halo = 0;
+
+	if (wl % 2 == 0) wl--;
+	m = (int)floor((var - n*wl*wl - 4*n*wl - 3*n)/(-4.0*wl - 4) + 0.5);  // number of smaller boxes
+	for (i=0; i < GAUSS_MAX_PASSES; i++)
+	{
+		r = i < n ? box_radius(((i < m ? wl : wl+2) - 1)/2) : 0;
+		if (param[0] <= 0) r = 0;
+		if (radius != NULL) radius[i] = r;
+		halo += r;
+	}
+	return halo;
+}
+
+// gaussian blur of the pixels x0 <= x < x1, y0 <= y < y1 by repeated box blurs,
+// every pass computes the region the following passes read
+void gauss_filter_region(int width, int height, pixel out[height][width], pixel in[height][width], int x0, int y0, int x1, int y1, const int param[])
+{
+	static STREAM_LOCAL pixel temp[2][H*W];  // results of the passes (one per thread)
+	int radius[GAUSS_MAX_PASSES];
+	int halo = gauss_radii(param,radius);
+	int i, last = GAUSS_MAX_PASSES-1, pass = 0;
+	pixel (*src)[width] = in;
+	pixel (*dst)[width];
+
+	while (last > 0 && radius[last] == 0) last--;
+	for (i=0; i <= last; i++)
+	{
+		if (radius[i] == 0 && i < last) continue;
+		halo -= radius[i];  // the later passes read this around the region
+		dst = i == last ? out : (pixel (*)[width])temp[pass++ & 1];
+		box_filter_region(width,height,dst,src,x0-halo,y0-halo,x1+halo,y1+halo,&radius[i]);
+		src = dst;
+	}
+}
+
+enum { MORPH_ERODE, MORPH_DILATE, MORPH_OPEN, MORPH_CLOSE, MORPH_TOPHAT, MORPH_BLACKHAT };
+
+int morph_radius(int size)  // of a width or height of the rectangle (even sizes are enlarged by one)
+{
+	return clamp_int(size/2,0,MORPH_MAX_RADIUS);
+}
+
+int morph_halo(const int param[])  // pixels around the output the operation reads
+{
+	int r = morph_radius(param[1]) > morph_radius(param[2]) ? morph_radius(param[1]) : morph_radius(param[2]);
+
+	return param[0] >= MORPH_OPEN ? 2*r : r;
+}
+
+static inline pixel pixel_max(pixel a, pixel b)
+{
+	return a > b ? a : b;
+}
+
+// maxima of the windows i ... i+k-1 of the n+k-1 values v (v is overwritten): the values are split into blocks
+// of k, g is the maximum from the start of the block, h (in v) up to its end, every window covers the end of one
+// block and the start of the next, so its maximum is max(h[i],g[i+k-1]) (van Herk/Gil-Werman)
+static void vhgw_line(pixel *out, pixel *v, pixel *g, int n, int k)
+{
+	int b, e, i, m = n+k-1;
+
+	for (b=0; b < m; b+=k)
+	{
+		e = b+k < m ? b+k : m;
+		g[b] = v[b];
+		for (i=b+1; i < e; i++) g[i] = pixel_max(g[i-1],v[i]);
+		for (i=e-2; i >= b; i--) v[i] = pixel_max(v[i],v[i+1]);
+	}
+	for (i=0; i < n; i++) out[i] = pixel_max(v[i],g[i+k-1]);
+}
+
+// maximum (m = 0) or minimum (m = PIXEL_MAX: max of the inverted pixels, inverted again) of the rectangle
+// (2*rx+1) x (2*ry+1) for the pixels x0 <= x < x1, y0 <= y < y1, the edge pixels are repeated at the border;
+// horizontal pass line by line, the vertical pass works on whole lines (the compiler vectorizes the loops over x)
+static void morph_pass(int width, int height, pixel out[height][width], pixel in[height][width], int x0, int y0, int x1, int y1, int rx, int ry, pixel m)
+{
+	static STREAM_LOCAL pixel h[(H+2*MORPH_MAX_RADIUS)*W], g[(H+2*MORPH_MAX_RADIUS)*W];  // lines of the vertical pass (one per thread)
+	pixel v[W+2*MORPH_MAX_RADIUS], gl[W+2*MORPH_MAX_RADIUS];
+	const pixel *line;
+	int n, lines, kx = 2*rx+1, ky = 2*ry+1;
+	int b, e, i, x, lo, hi;
+
+	x0 = clamp_int(x0,0,width);
+	y0 = clamp_int(y0,0,height);
+	x1 = clamp_int(x1,0,width);
+	y1 = clamp_int(y1,0,height);
+	if (x0 >= x1 || y0 >= y1)
+	{
+		return;
+	}
+	n = x1-x0;
+	lines = y1-y0+2*ry;
+	lo = clamp_int(x0-rx,0,width);  // pixels of a line inside of the image
+	hi = clamp_int(x1+rx,0,width);
+
+	for (i=0; i < lines; i++)  // horizontal maxima of the lines y0-ry ... y1+ry-1
+	{
+		line = in[clamp_int(y0-ry+i,0,height-1)];
+		for (x=x0-rx; x < lo; x++) v[x-x0+rx] = line[0] ^ m;
+		for (x=lo; x < hi; x++) v[x-x0+rx] = line[x] ^ m;
+		for (x=hi; x < x1+rx; x++) v[x-x0+rx] = line[width-1] ^ m;
+		vhgw_line(&h[i*n],v,gl,n,kx);
+	}
+
+	for (b=0; b < lines; b+=ky)  // vertical: the same with whole lines
+	{
+		e = b+ky < lines ? b+ky : lines;
+		memcpy(&g[b*n],&h[b*n],n*sizeof(pixel));
+		for (i=b+1; i < e; i++)
+		{
+			for (x=0; x < n; x++) g[i*n+x] = pixel_max(g[(i-1)*n+x],h[i*n+x]);
+		}
+		for (i=e-2; i >= b; i--)
+		{
+			for (x=0; x < n; x++) h[i*n+x] = pixel_max(h[i*n+x],h[(i+1)*n+x]);
+		}
+	}
+	for (i=0; i < y1-y0; i++)
+	{
+		for (x=0; x < n; x++) out[y0+i][x0+x] = pixel_max(h[i*n+x],g[(i+ky-1)*n+x]) ^ m;
+	}
+}
+
+// morphology of the pixels x0 <= x < x1, y0 <= y < y1 with the rectangle param[1] x param[2], param[0] selects
+// the operation: MORPH_ERODE (minimum), MORPH_DILATE (maximum), MORPH_OPEN (erosion, then dilation: removes bright
+// details smaller than the rectangle, e.g. reflections), MORPH_CLOSE (dilation, then erosion: removes dark details),
+// MORPH_TOPHAT (image - opening: the bright details) or MORPH_BLACKHAT (closing - image: the dark details);
+// the first pass of the combined operations computes the region the second one reads
+void morph_filter_region(int width, int height, pixel out[height][width], pixel in[height][width], int x0, int y0, int x1, int y1, const int param[])
+{
+	static STREAM_LOCAL pixel temp[H*W];  // result of the first pass (one per thread)
+	pixel (*first)[width] = (pixel (*)[width])temp;
+	int op = param[0];
+	int rx = morph_radius(param[1]), ry = morph_radius(param[2]);
+	int x, y;
+
+	if (op == MORPH_ERODE || op == MORPH_DILATE)
+	{
+		morph_pass(width,height,out,in,x0,y0,x1,y1,rx,ry,op == MORPH_ERODE ? PIXEL_MAX : 0);
+		return;
+	}
+	morph_pass(width,height,first,in,x0-rx,y0-ry,x1+rx,y1+ry,rx,ry,op == MORPH_CLOSE || op == MORPH_BLACKHAT ? 0 : PIXEL_MAX);
+	morph_pass(width,height,out,first,x0,y0,x1,y1,rx,ry,op == MORPH_CLOSE || op == MORPH_BLACKHAT ? PIXEL_MAX : 0);
+	if (op == MORPH_TOPHAT || op == MORPH_BLACKHAT)
+	{
+		x0 = clamp_int(x0,0,width);
+		y0 = clamp_int(y0,0,height);
+		x1 = clamp_int(x1,0,width);
+		y1 = clamp_int(y1,0,height);
+		for (y=y0; y < y1; y++)
+		{
+			for (x=x0; x < x1; x++)
+			{
+				out[y][x] = op == MORPH_TOPHAT ? in[y][x] - out[y][x] : out[y][x] - in[y][x];
+			}
+		}
+	}
+}
+
+enum { EDGE_MAGNITUDE, EDGE_ORIENTATION, EDGE_OVERLAY };
+
+// direction of the gradient in 256 steps for 0..180 degree (edges have no sign),
+// fixed point approximation of atan2: atan(r) = pi/4*r + 0.273*r*(1-r), error below one step
+static inline uint8_t edge_angle(int gx, int gy)
+{
+	int ax, ay, r, t;
+
+	if (gy < 0 || (gy == 0 && gx < 0))
+	{
+		gx = -gx;
+		gy = -gy;
+	}
+	ax = gx < 0 ? -gx : gx;
+	ay = gy;
+	if (ax == 0 && ay == 0)
+	{
+		return 0;
+	}
+	r = ax >= ay ? ((ay << 8) + ax/2)/ax : ((ax << 8) + ay/2)/ay;  // ratio in 1/256
+	t = (64*r + ((r*(256-r)*89) >> 10) + 128) >> 8;               // atan(r) in steps (64 for 45 degree)
+	if (ax >= ay)
+	{
+		return gx >= 0 ? t : 256 - t;
+	}
+	return gx >= 0 ? 128 - t : 128 + t;
+}
+
+// gradient with Sobel (param[0] = 0) or Scharr (1) in x and y in one sweep over the image:
+// the vertical smoothing and difference of three lines is computed once per column and used by
+// both directions, all line loops work on int16 values (int32 with more than 8 bit) so the compiler
+// vectorizes them (NEON/SSE), the magnitude is |Gx|+|Gy| (param[1] = 1) or max+3/8*min as approximation
+// of the length (2), param[2] selects the result: EDGE_MAGNITUDE, EDGE_ORIENTATION (0..255 for 0..180 degree,
+// on the 8 bit scale) or
+// EDGE_OVERLAY (edges blended onto the image with param[3] percent),
+// the pixels x0 <= x < x1, y0 <= y < y1 are computed (border pixels are skipped)
+void edge_filter_region(int width, int height, pixel out[height][width], pixel in[height][width], int x0, int y0, int x1, int y1, const int param[])
+{
+	pixel_diff s[W], d[W], gx[W], gy[W], mag[W];  // smoothed column, difference of the column, gradient
+	const int a = param[0] ? 3 : 1;              // weights of the neighbours and the center
+	const int b = param[0] ? 10 : 2;
+	const int shift = param[0] ? 4 : 2;          // weights of Scharr add up to 16, of Sobel to 4
+	const int strength = param[3]*256/100;
+	pixel_diff ax, ay, mx, mn;
+	int x, y, n, m;
+
+	if (y0 < 1) y0 = 1;
+	if (x0 < 1) x0 = 1;
+	if (y1 > height-1) y1 = height-1;
+	if (x1 > width-1) x1 = width-1;
+	if (x0 >= x1 || y0 >= y1)
+	{
+		return;
+	}
+	n = x1-x0;
+
+	for (y=y0; y < y1; y++)  // loop over all lines of region
+	{
+		const pixel *l0 = &in[y-1][x0-1], *l1 = &in[y][x0-1], *l2 = &in[y+1][x0-1];
+
+		for (x=0; x < n+2; x++)  // columns x0-1 ... x1
+		{
+			s[x] = a*l0[x] + b*l1[x] + a*l2[x];
+			d[x] = l2[x] - l0[x];
+		}
+		for (x=0; x < n; x++)
+		{
+			gx[x] = s[x+2] - s[x];
+			gy[x] = a*d[x] + b*d[x+1] + a*d[x+2];
+		}
+		for (x=0; x < n; x++)
+		{
+			ax = gx[x] < 0 ? -gx[x] : gx[x];
+			ay = gy[x] < 0 ? -gy[x] : gy[x];
+			if (param[1] == 2)
+			{
+				mx = ax > ay ? ax : ay;
+				mn = ax > ay ? ay : ax;
+				mag[x] = (mx + ((3*mn) >> 3)) >> shift;
+			}
+			else
+			{
+				mag[x] = (ax + ay) >> shift;
+			}
+			mag[x] = mag[x] > PIXEL_MAX ? PIXEL_MAX : mag[x];
+		}
+
+		switch (param[2])
+		{
+			case EDGE_ORIENTATION:
+				for (x=0; x < n; x++)
+				{
+					out[y][x0+x] = edge_angle(gx[x],gy[x]) << PIXEL_SHIFT;
+				}
+				break;
+			case EDGE_OVERLAY:  // push the pixels towards white with the edge strength
+				for (x=0; x < n; x++)
+				{
+					m = ((mag[x] >> PIXEL_SHIFT)*strength) >> 8;  // weight 0 ... 255
+					m = m > 255 ? 255 : m;
+					out[y][x0+x] = l1[x+1] + (((PIXEL_MAX - l1[x+1])*m + 127) / 255);
+				}
+				break;
+			default:
+				for (x=0; x < n; x++)
+				{
+					out[y][x0+x] = mag[x];
+				}
+		}
+	}
+}
+
+uint32_t hash_params(uint32_t key, const void *data, size_t n);
+int load_remap_grid(const char *file, uint32_t *hash);
+
+///////////////////////////////////////////////////////////////////////////////
+// convolution with user kernels (stage "kernel")
+// small kernels are computed directly, large ones in the frequency domain: the region is cut into
+// blocks, every block is transformed, multiplied with the cached spectrum of the kernel and the
+// inverse transforms are added with overlap (overlap-add), the cheaper way is chosen per call
+///////////////////////////////////////////////////////////////////////////////
+
+enum { CONV_AUTO, CONV_DIRECT, CONV_FFT };
+
+typedef struct
+{
+	char file[32];                      // kernel file
+	int width, height;                  // size of the kernel
+	double scale, offset;               // result = sum/scale + offset (as g and h of the FIR filter)
+	float coef[KERNEL_MAX][KERNEL_MAX]; // coefficients, applied like c[K][K] of the FIR filter
+	uint32_t hash;                      // content of the file (part of the cache key)
+	float complex *spectrum[FFT_LOG_MAX+1]; // spectrum for the FFT size 1<<i (computed when needed)
+} conv_kernel;
+
+STREAM_LOCAL conv_kernel kernels[MAX_KERNELS];  // kernels of the current settings
+STREAM_LOCAL int kernel_count;
+
+// e^(-2 pi i k/n) for k < n/2
+static const float complex *fft_twiddles(int n)
+{
+	static STREAM_LOCAL float complex table[FFT_MAX/2];
+	static STREAM_LOCAL int size = 0;
+	int k;
+
+	if (size != n)
+	{
+		for (k=0; k < n/2; k++)
+		{
+			table[k] = cexp(-2*M_PI*I*k/n);
+		}
+		size = n;
+	}
+	return table;
+}
+
+// in-place radix-2 FFT of n complex values (inverse without the factor 1/n)
+static void fft(float complex *a, int n, int inverse)
+{
+	const float complex *w = fft_twiddles(n);
+	float complex t,u,v;
+	int i,j,k,len,bit;
+
+	for (i=1, j=0; i < n; i++)  // bit reversed order
+	{
+		for (bit=n>>1; j & bit; bit >>= 1) j ^= bit;
+		j ^= bit;
+		if (i < j)
+		{
+			t = a[i];
+			a[i] = a[j];
+			a[j] = t;
+		}
+	}
+	for (len=2; len <= n; len <<= 1)  // butterflies
+	{
+		for (i=0; i < n; i += len)
+		{
+			for (k=0; k < len/2; k++)
+			{
+				t = inverse ? conjf(w[k*(n/len)]) : w[k*(n/len)];
+				u = a[i+k];
+				v = a[i+k+len/2]*t;
+				a[i+k] = u+v;
+				a[i+k+len/2] = u-v;
+			}
+		}
+	}
+}
+
+// 2D FFT of a real n x n block, only the lines < rows are not 0, spectrum has n x (n/2+1) values
+// (the others follow from symmetry), two lines are transformed at once as real and imaginary part
+static void fft2d_real(float complex *spec, const float *in, int n, int rows)
+{
+	float complex line[FFT_MAX];
+	float complex z1,z2;
+	int x,y,k,h = n/2+1;
+
+	for (y=0; y < n; y += 2)  // loop over pairs of lines
+	{
+		if (y >= rows)
+		{
+			memset(&spec[y*h],0,2*h*sizeof(spec[0]));
+			continue;
+		}
+		for (x=0; x < n; x++)
+		{
+			line[x] = in[y*n+x] + I*in[(y+1)*n+x];
+		}
+		fft(line,n,0);
+		for (k=0; k < h; k++)  // separate the spectra of the two lines
+		{
+			z1 = line[k];
+			z2 = conjf(line[(n-k) & (n-1)]);
+			spec[y*h+k] = 0.5f*(z1+z2);
+			spec[(y+1)*h+k] = -0.5f*I*(z1-z2);
+		}
+	}
+	for (k=0; k < h; k++)  // loop over all columns
+	{
+		for (y=0; y < n; y++) line[y] = spec[y*h+k];
+		fft(line,n,0);
+		for (y=0; y < n; y++) spec[y*h+k] = line[y];
+	}
+}
+
+// inverse of fft2d_real() without the factor 1/n^2, the spectrum is overwritten
+static void ifft2d_real(float *out, float complex *spec, int n)
+{
+	float complex line[FFT_MAX];
+	int x,y,k,h = n/2+1;
+
+	for (k=0; k < h; k++)  // loop over all columns
+	{
+		for (y=0; y < n; y++) line[y] = spec[y*h+k];
+		fft(line,n,1);
+		for (y=0; y < n; y++) spec[y*h+k] = line[y];
+	}
+	for (y=0; y < n; y += 2)  // two real lines as real and imaginary part of one transform
+	{
+		for (k=0; k < h; k++)
+		{
+			line[k] = spec[y*h+k] + I*spec[(y+1)*h+k];
+		}
+		for (k=h; k < n; k++)
+		{
+			line[k] = conjf(spec[y*h+n-k]) + I*conjf(spec[(y+1)*h+n-k]);
+		}
+		fft(line,n,1);
+		for (x=0; x < n; x++)
+		{
+			out[y*n+x] = crealf(line[x]);
+			out[(y+1)*n+x] = cimagf(line[x]);
+		}
+	}
+}
+
+static int log2_int(int n)
+{
+	int l = 0;
+
+	while ((1<<l) < n) l++;
+	return l;
+}
+
+// spectrum of the kernel for the FFT size n: mirrored (correlation like the FIR filter),
+// scaled by 1/(n^2*scale) for the inverse transform
+static const float complex *kernel_spectrum(conv_kernel *k, int n)
+{
+	float complex **spec = &k->spectrum[log2_int(n)];
+	float *block;
+	int x,y,h = n/2+1;
+
+	if (*spec == NULL)
+	{
+		block = calloc(n*n,sizeof(float));
+		*spec = malloc(n*h*sizeof(float complex));
+		if (block == NULL || *spec == NULL)
+		{
+			fprintf(log_file,"Error allocating memory ==> exit.\n");
+			exit(-1);
+		}
+		for (y=0; y < k->height; y++)
+		{
+			for (x=0; x < k->width; x++)
+			{
+				block[y*n+x] = k->coef[k->height-1-y][k->width-1-x]/(k->scale*n*n);
+			}
+		}
+		fft2d_real(*spec,block,n,k->height + (k->height & 1));
+		free(block);
+	}
+	return *spec;
+}
+
+// FFT size with the least cost for a region of rw x rh pixels (returns 0 if no size fits)
+static int conv_fft_size(const conv_kernel *k, int rw, int rh, double *cost)
+{
+	int n, best = 0, bw, bh;
+	double c;
+
+	for (n=16; n <= FFT_MAX; n *= 2)
+	{
+		bw = n - k->width + 1;   // block size of the input
+		bh = n - k->height + 1;
+		if (bw < 1 || bh < 1) continue;
+		c = (double)((rw+bw-1)/bw) * ((rh+bh-1)/bh) * FFT_COST*n*n*(log2_int(n)+4);  // +4: copies and product
+		if (best == 0 || c < *cost)
+		{
+			best = n;
+			*cost = c;
+		}
+		if (bw >= rw && bh >= rh) break;  // one block is enough
+	}
+	return best;
+}
+
+STREAM_LOCAL float *conv_block;            // buffers of the FFT convolution, grown to the largest size so far
+STREAM_LOCAL float complex *conv_spec;
+STREAM_LOCAL int conv_n;                   // FFT size of conv_block and conv_spec
+STREAM_LOCAL float *conv_acc;              // result of the convolution of a region
+STREAM_LOCAL size_t conv_acc_size;         // elements of conv_acc
+
+static inline pixel conv_result(const conv_kernel *k, double sum)
+{
+	sum = sum + k->offset*(1<<PIXEL_SHIFT) + 0.5;  // offset on the 8 bit scale
+	return sum <= 0 ? 0 : sum >= PIXEL_MAX ? PIXEL_MAX : (pixel)sum;
+}
+
+// convolution of the pixels x0 <= x < x1, y0 <= y < y1 with kernels[param[1]], param[0] = CONV_...
+// (border pixels without complete window are skipped, as for the FIR filter)
+void kernel_filter_region(int width, int height, pixel out[height][width], pixel in[height][width], int x0, int y0, int x1, int y1, const int param[])
+{
+	conv_kernel *k = &kernels[param[1]];
+	int ax = k->width/2, ay = k->height/2;  // position of the output pixel in the kernel
+	int n, bw, bh, iw, ih, aw, ah, bx, by, x, y, i, j, h;
+	double cost_fft = 0, sum;
+	const float complex *ks;
+	float complex *spec;
+	float *block, *acc;
+
+	if (y0 < ay) y0 = ay;
+	if (x0 < ax) x0 = ax;
+	if (y1 > height-(k->height-1-ay)) y1 = height-(k->height-1-ay);
+	if (x1 > width-(k->width-1-ax)) x1 = width-(k->width-1-ax);
+	if (x0 >= x1 || y0 >= y1)
+	{
+		return;
+	}
+
+	n = conv_fft_size(k,x1-x0,y1-y0,&cost_fft);
+	if (param[0] == CONV_DIRECT || n == 0 ||
+	    (param[0] == CONV_AUTO && (double)(x1-x0)*(y1-y0)*k->width*k->height <= cost_fft))
+	{
+		for (y=y0; y < y1; y++)  // loop over all lines of region
+		{
+			for (x=x0; x < x1; x++)  // loop over all rows of region
+			{
+				sum = 0;
+				for (i=0; i < k->height; i++)
+				{
+					const pixel *l = &in[y-ay+i][x-ax];
+					for (j=0; j < k->width; j++) sum += k->coef[i][j]*l[j];
+				}
+				out[y][x] = conv_result(k,sum/k->scale);
+			}
+		}
+		return;
+	}
+
+	ks = kernel_spectrum(k,n);
+	h = n/2+1;
+	bw = n - k->width + 1;
+	bh = n - k->height + 1;
+	iw = x1-x0 + k->width-1;   // input of the region (starts at x0-ax, y0-ay)
+	ih = y1-y0 + k->height-1;
+	aw = iw + k->width-1;      // complete result of the convolution
+	ah = ih + k->height-1;
+	if (n > conv_n)
+	{
+		free(conv_block);
+		free(conv_spec);
+		conv_n = n;
+		conv_block = malloc(n*n*sizeof(float));
+		conv_spec = malloc(n*h*sizeof(float complex));
+	}
+	if ((size_t)aw*ah > conv_acc_size)
+	{
+		free(conv_acc);
+		conv_acc_size = (size_t)aw*ah;
+		conv_acc = malloc(conv_acc_size*sizeof(float));
+	}
+	if (conv_block == NULL || conv_spec == NULL || conv_acc == NULL)
+	{
+		fprintf(log_file,"Error allocating memory ==> exit.\n");
+		exit(-1);
+	}
+	block = conv_block;
+	spec = conv_spec;
+	acc = conv_acc;
+	memset(acc,0,(size_t)aw*ah*sizeof(float));
+
+	for (by=0; by < ih; by += bh)  // loop over all blocks of the input
+	{
+		for (bx=0; bx < iw; bx += bw)
+		{
+			memset(block,0,n*n*sizeof(float));
+			for (y=0; y < bh && by+y < ih; y++)
+			{
+				const pixel *l = &in[y0-ay+by+y][x0-ax+bx];
+				for (x=0; x < bw && bx+x < iw; x++) block[y*n+x] = l[x];
+			}
+			fft2d_real(spec,block,n,y + (y & 1));
+			for (i=0; i < n*h; i++) spec[i] *= ks[i];
+			ifft2d_real(block,spec,n);
+			for (y=0; y < n && by+y < ah; y++)  // overlap-add
+			{
+				for (x=0; x < n && bx+x < aw; x++) acc[(by+y)*aw+bx+x] += block[y*n+x];
+			}
+		}
+	}
+	for (y=y0; y < y1; y++)  // output pixel x is element x-x0+width-1 of the convolution
+	{
+		for (x=x0; x < x1; x++)
+		{
+			out[y][x] = conv_result(k,acc[(y-y0+k->height-1)*aw + x-x0+k->width-1]);
+		}
+	}
+}
+
+// read a kernel file: "width height scale offset" followed by width*height coefficients line by line,
+// '#' starts a comment, returns the index in kernels[] or -1
+int load_kernel(const char *file)
+{
+	conv_kernel *k;
+	FILE *f;
+	char *buffer = NULL, *p, *end;
+	size_t size = 0;
+	double v[4+KERNEL_MAX*KERNEL_MAX];
+	int n = 0, i;
+
+	f = fopen(file,"r");
+	if (f == NULL)
+	{
+		fprintf(log_file,"kernel %s not found\n",file);
+		return -1;
+	}
+	while (getline(&buffer,&size,f) > 0 && n < (int)(sizeof(v)/sizeof(v[0])))
+	{
+		if ((p = strchr(buffer,'#')) != NULL) *p = 0;
+		for (p=buffer; n < (int)(sizeof(v)/sizeof(v[0])); p=end)
+		{
+			v[n] = strtod(p,&end);
+			if (end == p) break;
+			n++;
+		}
+	}
+	fclose(f);
+	free(buffer);
+
+	if (n < 4 || v[0] < 1 || v[0] > KERNEL_MAX || v[1] < 1 || v[1] > KERNEL_MAX || v[2] == 0 || n != 4+(int)v[0]*(int)v[1] ||
+	    kernel_count >= MAX_KERNELS)
+	{
+		fprintf(log_file,"kernel %s is invalid\n",file);
+		return -1;
+	}
+	k = &kernels[kernel_count];
+	for (i=0; i <= FFT_LOG_MAX; i++)  // spectra of the kernel that was here before
+	{
+		free(k->spectrum[i]);
+	}
+	memset(k,0,sizeof(*k));
+	strncpy(k->file,file,sizeof(k->file)-1);
+	k->width = v[0];
+	k->height = v[1];
+	k->scale = v[2];
+	k->offset = v[3];
+	for (i=0; i < k->width*k->height; i++)
+	{
+		k->coef[i/k->width][i%k->width] = v[4+i];
+	}
+	k->hash = hash_params(0,v,n*sizeof(v[0]));
+	return kernel_count++;
+}
+
+// reduce the image size by 2 in both directions (mean of 2x2 pixels)
+void downscale2(int width, int height, pixel out[height/2][width/2], pixel in[height][width])
+{
+	int x,y;
+
+	for (y=0; y < height/2; y++)  // loop over all lines of output
+	{
+		const pixel *l0 = in[2*y];
+		const pixel *l1 = in[2*y+1];
+		for (x=0; x < width/2; x++)  // loop over all rows of output
+		{
+			out[y][x] = (l0[2*x] + l0[2*x+1] + l1[2*x] + l1[2*x+1] + 2) >> 2;
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// pipeline description and planner
+// the settings describe the processing as a list of stages, the planner turns it into the
+// cheapest equivalent plan: identities are dropped, point operations are moved behind zoom and
+// flips (they read through the view), neighbouring stages of the same type are fused and the
+// filters in front of a zoom only compute the region the zoom shows
+///////////////////////////////////////////////////////////////////////////////
+
+// new stages: add the type here (before STAGE_OUTPUT), to stage_types[] and to execute_plan()
+enum { STAGE_FIR, STAGE_MEDIAN, STAGE_BOX, STAGE_GAUSS, STAGE_KERNEL, STAGE_EDGE, STAGE_MORPH, STAGE_ZOOM, STAGE_BRIGHTNESS, STAGE_TEMPORAL, STAGE_FLIP, STAGE_ROTATION, STAGE_REMAP, STAGE_OUTPUT, STAGES };
+
+enum
+{
+	KIND_FILTER,   // neighbourhood operation on a buffer, can be restricted to a region
+	KIND_POINT,    // pixel by pixel through a lookup table, reads through views
+	KIND_VIEW,     // geometric operation that only changes the view (no pass over the image)
+	KIND_GEOMETRY  // geometric operation that resamples the image
+};
+
+#define STAGE_PARAMS 4   // max. number of parameters of a stage
+#define MAX_STAGES   16  // max. number of stages of a pipeline
+
+typedef void (*region_filter)(int width, int height, pixel out[][W], pixel in[][W], int x0, int y0, int x1, int y1, const int param[]);
+
+typedef struct
+{
+	const char *name;                  // name in the settings file
+	int kind;                          // KIND_...
+	int halo;                          // pixels around the output a filter reads (see stage_halo())
+	region_filter filter;              // function of a filter
+	const char *params[STAGE_PARAMS];  // names of the parameters
+	int defaults[STAGE_PARAMS];        // values of parameters missing in the settings
+	int has_file;                      // the stage reads a file (parameter "file" or a name without '=')
+} stage_info;
+
+const stage_info stage_types[STAGES] =
+{
+	[STAGE_FIR]        = { "fir",        KIND_FILTER,   K>>1, fir_filter_region,    { NULL },               { 0 } },
+	[STAGE_MEDIAN]     = { "median",     KIND_FILTER,   1,    median_filter_region, { NULL },               { 0 } },
+	[STAGE_BOX]        = { "box",        KIND_FILTER,   0,    box_filter_region,    { "radius" },           { 1 } },
+	[STAGE_GAUSS]      = { "gauss",      KIND_FILTER,   0,    gauss_filter_region,  { "sigma", "passes" },  { 2, 3 } },
+	[STAGE_KERNEL]     = { "kernel",     KIND_FILTER,   0,    kernel_filter_region, { "method" },           { CONV_AUTO, -1 }, 1 },  // param[1]: index in kernels[]
+	[STAGE_EDGE]       = { "edge",       KIND_FILTER,   1,    edge_filter_region,   { "scharr", "norm", "output", "strength" }, { 0, 1, EDGE_MAGNITUDE, 100 } },
+	[STAGE_MORPH]      = { "morph",      KIND_FILTER,   0,    morph_filter_region,  { "op", "width", "height" }, { MORPH_OPEN, 5, 5 } },
+	[STAGE_ZOOM]       = { "zoom",       KIND_VIEW,     0,    NULL,                 { "factor" },           { 2 } },
+	[STAGE_BRIGHTNESS] = { "brightness", KIND_POINT,    0,    NULL,                 { "offset", "auto" },   { 0, EXPOSURE_MANUAL } },
+	[STAGE_TEMPORAL]   = { "temporal",   KIND_POINT,    0,    NULL,                 { "strength", "noise" }, { 75, 8 } },
+	[STAGE_FLIP]       = { "flip",       KIND_VIEW,     0,    NULL,                 { "axis" },             { 1 } },  // 1 vertical, 2 horizontal, 3 both axes
+	[STAGE_ROTATION]   = { "rotation",   KIND_GEOMETRY, 0,    NULL,                 { "angle" },            { 90 } },
+	[STAGE_REMAP]      = { "remap",      KIND_GEOMETRY, 0,    NULL,                 { "k1", "k2", "vignette" }, { 0, 0, 0 }, 1 },
+	[STAGE_OUTPUT]     = { "output",     KIND_VIEW,     0,    NULL,                 { NULL },               { 0 } },
+};
+
+typedef struct
+{
+	int type;                 // STAGE_...
+	int param[STAGE_PARAMS];  // parameters in the order of stage_types[type].params
+	int extra[MAX_STAGES];    // offsets of fused manual brightness stages (applied after param[0]),
+	                          // views and rotations fused into a remap (type << 16 | parameter, see fuse_stages())
+	int extras;
+	int roi[4];               // region x0,y0,x1,y1 a filter has to compute (set by the planner)
+	char file[32];            // file of the stage (kernel)
+	uint32_t data;            // hash of the content of the file
+} stage_t;
+
+typedef struct
+{
+	stage_t stage[MAX_STAGES];
+	int count;
+} pipeline_t;
+
+static void add_stage(pipeline_t *p, int type, int param0, int param1)
+{
+	stage_t *st;
+
+	if (p->count >= MAX_STAGES)
+	{
+		fprintf(log_file,"too many stages, %s ignored\n",stage_types[type].name);
+		return;
+	}
+	st = &p->stage[p->count++];
+	memset(st,0,sizeof(*st));  // the stage is hashed as a whole for the cache keys
+	st->type = type;
+	st->param[0] = param0;
+	st->param[1] = param1;
+	st->roi[2] = W;
+	st->roi[3] = H;
+}
+
+// one stage per line: name [value ...] [parameter=value ...], e.g. "zoom 2" or "brightness offset=20 auto=1"
+static void parse_stage(pipeline_t *p, char *line)
+{
+	const stage_info *info;
+	stage_t *st;
+	char *token = strtok(line," \t\r\n");
+	char *value;
+	int type, n = 0, k;
+
+	for (type=0; type < STAGE_OUTPUT && strcmp(token,stage_types[type].name) != 0; type++);
+	if (type == STAGE_OUTPUT)
+	{
+		fprintf(log_file,"unknown stage %s ignored\n",token);
+		return;
+	}
+	info = &stage_types[type];
+	for (k=0; k < p->count && !((type == STAGE_TEMPORAL || type == STAGE_REMAP) && p->stage[k].type == type); k++);
+	if (k < p->count)
+	{
+		fprintf(log_file,"only one %s stage (one history or table), the second is ignored\n",token);
+		return;
+	}
+	add_stage(p,type,0,0);
+	memcpy(p->stage[p->count-1].param,info->defaults,sizeof(info->defaults));
+
+	while ((token = strtok(NULL," \t\r\n")) != NULL && *token != '#')
+	{
+		k = n;  // positional parameter
+		value = strchr(token,'=');
+		if (value != NULL)
+		{
+			*value++ = 0;
+			for (k=0; k < STAGE_PARAMS && (info->params[k] == NULL || strcmp(token,info->params[k]) != 0); k++);
+		}
+		else
+		{
+			value = token;
+		}
+		if (info->has_file && (strcmp(token,"file") == 0 || (value == token && strspn(token,"-0123456789") == 0)))
+		{
+			strncpy(p->stage[p->count-1].file,value,sizeof(p->stage[0].file)-1);
+		}
+		else if (k < STAGE_PARAMS && info->params[k] != NULL)
+		{
+			p->stage[p->count-1].param[k] = atoi(value);
+			n += value == token;
+		}
+		else
+		{
+			fprintf(log_file,"unknown parameter %s of stage %s ignored\n",token,info->name);
+		}
+	}
+
+	if (type == STAGE_KERNEL)
+	{
+		st = &p->stage[p->count-1];
+		st->param[1] = load_kernel(st->file);
+		if (st->param[1] < 0)
+		{
+			p->count--;  // stage without kernel
+			return;
+		}
+		st->data = kernels[st->param[1]].hash;
+	}
+	if (type == STAGE_REMAP && p->stage[p->count-1].file[0])
+	{
+		st = &p->stage[p->count-1];
+		if (load_remap_grid(st->file,&st->data) < 0)
+		{
+			p->count--;  // stage without grid
+			return;
+		}
+	}
+}
+
+// read the settings: a list of stages or the old format with one number per line
+// (fir, median, zoom, brightness, flip, rotation, exposure) which describes the fixed order of the stages
+void read_settings_file(FILE *settings_file, pipeline_t *p)  // settings from an open file (see SETTINGS_FILENAME)
+{
+	char *buffer = NULL, *line;
+	size_t size = 0;
+	int values[7] = { 0 };  // old format, missing lines are 0 (older files have no exposure line)
+	int n = 0, named = 0;
+
+	p->count = 0;
+	kernel_count = 0;
+	while (getline(&buffer,&size,settings_file) > 0)  // read from settings file
+	{
+		line = buffer + strspn(buffer," \t");
+		if (*line == '#' || *line == '\n' || *line == '\r' || *line == 0)  // comment or empty line
+		{
+			continue;
+		}
+		if ((*line >= 'a' && *line <= 'z') || (*line >= 'A' && *line <= 'Z'))
+		{
+			parse_stage(p,line);
+			named = 1;
+		}
+		else if (n < 7)
+		{
+			sscanf(line, "%d", &values[n++]);  // convert the line to an integer value of the parameter
+		}
+	}
+	free(buffer);
+
+	if (!named)
+	{
+		if (values[0] == 1) add_stage(p,STAGE_FIR,0,0);
+		if (values[1] == 1) add_stage(p,STAGE_MEDIAN,0,0);
+		add_stage(p,STAGE_ZOOM,values[2],0);
+		add_stage(p,STAGE_BRIGHTNESS,values[3],values[6]);
+		add_stage(p,STAGE_FLIP,values[4],0);
+		add_stage(p,STAGE_ROTATION,values[5],0);
+	}
+}
+
+void read_settings(char *filename, pipeline_t *p)
+{
+	FILE *settings_file = open_file(filename, "r");
+
+	read_settings_file(settings_file,p);
+	fclose(settings_file);
+}
+
+void print_pipeline(FILE *f, const char *title, const pipeline_t *p)
+{
+	const stage_t *st;
+	int i,k;
+
+	fprintf(f,"%s:",title);
+	for (i=0; i < p->count; i++)
+	{
+		st = &p->stage[i];
+		fprintf(f,"%s %s",i ? " ->" : "",stage_types[st->type].name);
+		for (k=0; k < STAGE_PARAMS && stage_types[st->type].params[k] != NULL; k++)
+		{
+			fprintf(f," %s=%d",stage_types[st->type].params[k],st->param[k]);
+		}
+		for (k=0; k < st->extras; k++)
+		{
+			if (st->type == STAGE_REMAP)
+			{
+				fprintf(f," +%s=%d",stage_types[st->extra[k] >> 16].name,st->extra[k] & 0xffff);
+			}
+			else
+			{
+				fprintf(f," %+d",st->extra[k]);
+			}
+		}
+		if (st->file[0])
+		{
+			fprintf(f," file=%s",st->file);
+		}
+		if (st->roi[0] != 0 || st->roi[1] != 0 || st->roi[2] != W || st->roi[3] != H)
+		{
+			fprintf(f," roi=%d,%d-%d,%d",st->roi[0],st->roi[1],st->roi[2],st->roi[3]);
+		}
+	}
+	fprintf(f,"%s\n",p->count ? "" : " (copy)");
+}
+
+// pixels around the output a filter reads
+static int stage_halo(const stage_t *st)
+{
+	switch (st->type)
+	{
+		case STAGE_BOX:   return box_radius(st->param[0]);
+		case STAGE_GAUSS: return gauss_radii(st->param,NULL);
+		case STAGE_MORPH: return morph_halo(st->param);
+		case STAGE_KERNEL:
+			return kernels[st->param[1]].width > kernels[st->param[1]].height ?
+			       kernels[st->param[1]].width/2 : kernels[st->param[1]].height/2;
+	}
+	return stage_types[st->type].halo;
+}
+
+static int is_identity(const stage_t *st)
+{
+	switch (st->type)
+	{
+		case STAGE_BOX:        return box_radius(st->param[0]) == 0;
+		case STAGE_GAUSS:      return gauss_radii(st->param,NULL) == 0;
+		case STAGE_MORPH:      return morph_halo(st->param) == 0 && st->param[0] <= MORPH_CLOSE;
+		case STAGE_ZOOM:       return st->param[0] <= 1;
+		case STAGE_BRIGHTNESS: return st->param[0] == 0 && st->param[1] == EXPOSURE_MANUAL && st->extras == 0;
+		case STAGE_TEMPORAL:   return st->param[0] <= 0;
+		case STAGE_FLIP:       return (st->param[0] & 3) == 0;
+		case STAGE_ROTATION:   return st->param[0] % 360 == 0;
+		case STAGE_REMAP:      return st->param[0] == 0 && st->param[1] == 0 && st->param[2] == 0 && st->file[0] == 0 && st->extras == 0;
+	}
+	return 0;
+}
+
+// part of a line (size n) a zoom shows: the same crop as in view_zoom()
+static void zoom_crop(int n, int faktor, int *start, int *length)
+{
+	*length = n/faktor;
+	*start = (faktor-1)*(*length>>1);
+}
+
+// zoom a then zoom b shows the same pixels as one zoom by a*b (the crops are rounded differently)
+static int zooms_fuse(int a, int b)
+{
+	int n[2] = { W, H };
+	int i, s1, l1, s2, l2, s, l;
+
+	for (i=0; i < 2; i++)
+	{
+		zoom_crop(n[i],a,&s1,&l1);
+		zoom_crop(n[i],b,&s2,&l2);   // crop of the second zoom in pixels of the first result
+		zoom_crop(n[i],a*b,&s,&l);
+		if (s2 % a != 0 || l2 % a != 0 || s1 + s2/a != s || l2/a != l) return 0;
+	}
+	return 1;
+}
+
+// with a remainder the zoom has black borders: a point operation behind it would change them
+static int zoom_is_exact(int faktor)
+{
+	return W % faktor == 0 && H % faktor == 0;
+}
+
+// try to replace the stages a and b (in this order) by one stage in a
+static int fuse_stages(stage_t *a, const stage_t *b)
+{
+	int k;
+
+	if (a->type == STAGE_REMAP && (b->type == STAGE_ZOOM || b->type == STAGE_FLIP || b->type == STAGE_ROTATION) && a->extras < MAX_STAGES)
+	{
+		// the table maps the output of the view or rotation, so lens correction and view are one pass
+		a->extra[a->extras++] = b->type << 16 | (b->type == STAGE_ROTATION ? ((b->param[0] % 360) + 360) % 360 : b->param[0] & 0xffff);
+		return 1;
+	}
+	if (a->type != b->type) return 0;
+	switch (a->type)
+	{
+		case STAGE_BRIGHTNESS:  // clamped offsets in a row, the auto correction is only allowed in the first
+			if (b->param[1] != EXPOSURE_MANUAL || a->extras + 1 + b->extras > MAX_STAGES) return 0;
+			a->extra[a->extras++] = b->param[0];
+			for (k=0; k < b->extras; k++) a->extra[a->extras++] = b->extra[k];
+			return 1;
+		case STAGE_FLIP:
+			a->param[0] ^= b->param[0];
+			return 1;
+		case STAGE_ZOOM:
+			if (!zooms_fuse(a->param[0],b->param[0])) return 0;
+			a->param[0] *= b->param[0];
+			return 1;
+		case STAGE_ROTATION:  // exact only if one of them turns the whole frame (180) and the other is exact too
+			if (!((a->param[0] % 180 == 0 && b->param[0] % 90 == 0) || (b->param[0] % 180 == 0 && a->param[0] % 90 == 0))) return 0;
+			a->param[0] = (a->param[0] + b->param[0]) % 360;
+			return 1;
+	}
+	return 0;
+}
+
+// point operations may be moved behind a view change (auto exposure only behind flips, it measures what it sees)
+static int point_commutes(const stage_t *a, const stage_t *b)
+{
+	if (stage_types[a->type].kind != KIND_POINT) return 0;
+	if (b->type == STAGE_FLIP) return 1;
+	return b->type == STAGE_ZOOM && zoom_is_exact(b->param[0]) &&
+	       !(a->type == STAGE_BRIGHTNESS && a->param[1] != EXPOSURE_MANUAL);
+}
+
+void plan_pipeline(pipeline_t *plan, const pipeline_t *p)
+{
+	stage_t temp;
+	int i, k, changed, halo, crop[4], n[2] = { W, H };
+
+	plan->count = 0;
+	for (i=0; i < p->count; i++)
+	{
+		if (!is_identity(&p->stage[i])) plan->stage[plan->count++] = p->stage[i];
+	}
+
+	do  // until nothing can be moved or fused anymore
+	{
+		changed = 0;
+		for (i=0; i+1 < plan->count; i++)
+		{
+			if (point_commutes(&plan->stage[i],&plan->stage[i+1]))
+			{
+				temp = plan->stage[i];
+				plan->stage[i] = plan->stage[i+1];
+				plan->stage[i+1] = temp;
+				changed = 1;
+			}
+			else if (fuse_stages(&plan->stage[i],&plan->stage[i+1]))
+			{
+				memmove(&plan->stage[i+1],&plan->stage[i+2],(plan->count-i-2)*sizeof(stage_t));
+				plan->count--;
+				if (is_identity(&plan->stage[i]))  // e.g. two flips around the same axis
+				{
+					memmove(&plan->stage[i],&plan->stage[i+1],(plan->count-i-1)*sizeof(stage_t));
+					plan->count--;
+				}
+				changed = 1;
+			}
+		}
+	} while (changed);
+
+	// crop before filtering: the filters directly in front of a zoom compute only its crop
+	// (plus the pixels the following filters read)
+	for (i=0; i < plan->count; i++)
+	{
+		if (plan->stage[i].type != STAGE_ZOOM) continue;
+		for (k=0; k < 2; k++)
+		{
+			zoom_crop(n[k],plan->stage[i].param[0],&crop[k],&crop[k+2]);
+			crop[k+2] += crop[k];
+		}
+		halo = 0;
+		for (k=i-1; k >= 0 && stage_types[plan->stage[k].type].kind == KIND_FILTER; k--)
+		{
+			plan->stage[k].roi[0] = crop[0]-halo > 0 ? crop[0]-halo : 0;
+			plan->stage[k].roi[1] = crop[1]-halo > 0 ? crop[1]-halo : 0;
+			plan->stage[k].roi[2] = crop[2]+halo < W ? crop[2]+halo : W;
+			plan->stage[k].roi[3] = crop[3]+halo < H ? crop[3]+halo : H;
+			halo += stage_halo(&plan->stage[k]);
+		}
+	}
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// geometric stages backwards: the source pixel of an output pixel
+///////////////////////////////////////////////////////////////////////////////
+
+// size of the view behind a zoom, flip or rotation whose input view has the size in[0] x in[1]
+static void geometry_size(int type, int param, const int in[2], int out[2])
+{
+	out[0] = type == STAGE_ZOOM ? (W/param)*param : type == STAGE_FLIP ? in[0] : W;
+	out[1] = type == STAGE_ZOOM ? (H/param)*param : type == STAGE_FLIP ? in[1] : H;
+}
+
+// source pixel (in the input view of the size w x h) of the output pixel (*x,*y) of a zoom, flip or rotation
+// as the views and rotation() compute it, returns 0 if it has none (the stage sets it to 0)
+static int geometry_source(int type, int param, int w, int h, int *x, int *y)
+{
+	int d = (W-H)/2, c = d+H-1;
+	int sx = *x, sy = *y, angle;
+	double cs, sn;
+
+	switch (type)
+	{
+		case STAGE_ZOOM:
+			sx = (param-1)*((W/param)>>1) + sx/param;
+			sy = (param-1)*((H/param)>>1) + sy/param;
+			break;
+
+		case STAGE_FLIP:
+			if (param & 1) sx = w-1-sx;
+			if (param & 2) sy = h-1-sy;
+			break;
+
+		case STAGE_ROTATION:
+			angle = ((param % 360) + 360) % 360;
+			if (angle == 90 || angle == 270)
+			{
+				sx = angle == 90 ? *y+d : c-*y;
+				sy = angle == 90 ? c-*x : *x-d;
+			}
+			else if (angle == 180)
+			{
+				sx = W-1-sx;
+				sy = H-1-sy;
+			}
+			else if (angle != 0)  // as rotation()
+			{
+				cs = cos((double)angle*3.14159265359/180);
+				sn = sin((double)angle*3.14159265359/180);
+				sx = (double)W/2 + ((double)*y-(double)H/2)*sn + ((double)*x-(double)W/2)*cs;
+				sy = (double)H/2 + ((double)*y-(double)H/2)*cs - ((double)*x-(double)W/2)*sn;
+			}
+			break;
+	}
+	*x = sx;
+	*y = sy;
+	return sx >= 0 && sx < w && sy >= 0 && sy < h;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// lens correction (stage "remap")
+// distortion model: the source of a pixel at the distance d from the center is center + d*(1 + k1*r^2 + k2*r^4)
+// with r = |d| / half diagonal (k1, k2 in 1/1000), vignetting: gain = 1 + vignette/100*r^2;
+// a grid file replaces the model; the zoom, flips and rotations behind the stage are fused into it, its table
+// maps their output, so the correction with the view is one pass; the table holds the source positions in fixed
+// point tile by tile, so a tile of the output reads a contiguous part of it and a small region of the input
+///////////////////////////////////////////////////////////////////////////////
+
+#if (W << REMAP_FRAC) > 32767 || (H << REMAP_FRAC) > 32767
+  #error "frame too large for the source positions of the remap table (REMAP_FRAC)"
+#endif
+
+#define REMAP_NONE     INT16_MIN                      // output pixel without source (0)
+#define REMAP_TILES_X  ((W+REMAP_TILE-1)/REMAP_TILE)
+#define REMAP_TILES_Y  ((H+REMAP_TILE-1)/REMAP_TILE)
+
+typedef struct
+{
+	int16_t x, y;  // source position in 1/(1<<REMAP_FRAC) pixel
+} remap_coord;
+
+typedef struct
+{
+	int width, height;  // points of the grid
+	int values;         // values per point: x, y (2) or x, y, gain (3)
+	float *v;
+} remap_grid;
+
+STREAM_LOCAL remap_grid lens_grid;     // grid of the current settings
+STREAM_LOCAL remap_coord *remap_table; // source positions, REMAP_TILES_X * REMAP_TILES_Y tiles
+STREAM_LOCAL uint16_t *remap_gain;     // gains in the same order (NULL: none)
+STREAM_LOCAL uint32_t remap_key;       // stage of the table
+
+static inline int remap_index(int x, int y)  // of the output pixel (x,y) in the table
+{
+	return ((y/REMAP_TILE)*REMAP_TILES_X + x/REMAP_TILE)*REMAP_TILE*REMAP_TILE + (y%REMAP_TILE)*REMAP_TILE + x%REMAP_TILE;
+}
+
+// grid file: width height, then "x y" or "x y gain" of every point line by line ('#' starts a comment),
+// point (i,j) belongs to the output pixel (i*(W-1)/(width-1), j*(H-1)/(height-1)), x y is its source position
+// in pixels, between the points the grid is interpolated; returns 0 (hash: content of the file) or -1
+int load_remap_grid(const char *file, uint32_t *hash)
+{
+	FILE *f;
+	char *buffer = NULL, *p, *end;
+	size_t size = 0;
+	float *v = NULL;
+	double d;
+	int n = 0, max = 0, points;
+
+	f = fopen(file,"r");
+	if (f == NULL)
+	{
+		fprintf(log_file,"remap grid %s not found\n",file);
+		return -1;
+	}
+	while (getline(&buffer,&size,f) > 0)
+	{
+		if ((p = strchr(buffer,'#')) != NULL) *p = 0;
+		for (p=buffer; ; p=end)
+		{
+			d = strtod(p,&end);
+			if (end == p) break;
+			if (n == max)
+			{
+				max = max ? 2*max : 1024;
+				v = realloc(v,max*sizeof(float));
+				if (v == NULL)
+				{
+					fprintf(log_file,"Error allocating memory ==> exit.\n");
+					exit(-1);
+				}
+			}
+			v[n++] = d;
+		}
+	}
+	fclose(f);
+	free(buffer);
+
+	points = n >= 2 && v[0] >= 2 && v[1] >= 2 && v[0] <= W && v[1] <= H ? (int)v[0]*(int)v[1] : 0;
+	if (points == 0 || (n-2 != 2*points && n-2 != 3*points))
+	{
+		fprintf(log_file,"remap grid %s is invalid\n",file);
+		free(v);
+		return -1;
+	}
+	free(lens_grid.v);
+	lens_grid.width = v[0];
+	lens_grid.height = v[1];
+	lens_grid.values = (n-2)/points;
+	memmove(v,v+2,(n-2)*sizeof(float));
+	lens_grid.v = v;
+	*hash = hash_params(0,v,(n-2)*sizeof(float));
+	return 0;
+}
+
+// source position and gain of the pixel (x,y) of the corrected frame
+static void lens_source(const stage_t *st, int x, int y, double *sx, double *sy, double *gain)
+{
+	const double cx = (W-1)/2.0, cy = (H-1)/2.0;
+	const double r2 = ((x-cx)*(x-cx) + (y-cy)*(y-cy)) / (cx*cx + cy*cy);
+	const int n = lens_grid.values;
+	double gx, gy, fx, fy, f, q[3] = { 0, 0, 1 };
+	const float *a, *b;
+	int i, j, k;
+
+	*gain = 1 + st->param[2]/100.0*r2;
+	if (st->file[0] == 0)
+	{
+		f = 1 + st->param[0]/1000.0*r2 + st->param[1]/1000.0*r2*r2;
+		*sx = cx + (x-cx)*f;
+		*sy = cy + (y-cy)*f;
+		return;
+	}
+	gx = (double)x*(lens_grid.width-1)/(W-1);  // between the points (i,j) ... (i+1,j+1) of the grid
+	gy = (double)y*(lens_grid.height-1)/(H-1);
+	i = gx < lens_grid.width-2 ? (int)gx : lens_grid.width-2;
+	j = gy < lens_grid.height-2 ? (int)gy : lens_grid.height-2;
+	fx = gx-i;
+	fy = gy-j;
+	for (k=0; k < n; k++)
+	{
+		a = &lens_grid.v[(j*lens_grid.width + i)*n + k];
+		b = a + lens_grid.width*n;
+		q[k] = (1-fy)*((1-fx)*a[0] + fx*a[n]) + fy*((1-fx)*b[0] + fx*b[n]);
+	}
+	*sx = q[0];
+	*sy = q[1];
+	if (n == 3) *gain = q[2];
+}
+
+// table of the stage with the views and rotations fused into it (computed again when the stage changed)
+static void remap_prepare(const stage_t *st)
+{
+	uint32_t key = hash_params(0,st,sizeof(*st));
+	int size[MAX_STAGES+1][2];
+	int n = st->extras;
+	int k;
+
+	if (remap_table != NULL && key == remap_key)
+	{
+		return;
+	}
+	if (remap_table == NULL)
+	{
+		remap_table = malloc(REMAP_TILES_X*REMAP_TILES_Y*REMAP_TILE*REMAP_TILE*sizeof(remap_coord));
+		remap_gain = malloc(REMAP_TILES_X*REMAP_TILES_Y*REMAP_TILE*REMAP_TILE*sizeof(uint16_t));
+		if (remap_table == NULL || remap_gain == NULL)
+		{
+			fprintf(log_file,"Error allocating memory ==> exit.\n");
+			exit(-1);
+		}
+	}
+	size[0][0] = W;
+	size[0][1] = H;
+	for (k=0; k < n; k++)
+	{
+		geometry_size(st->extra[k] >> 16,st->extra[k] & 0xffff,size[k],size[k+1]);
+	}
+
+	#pragma omp parallel for schedule(static)
+	for (int y=0; y < H; y++)
+	{
+		for (int x=0; x < W; x++)
+		{
+			remap_coord c = { REMAP_NONE, REMAP_NONE };
+			double sx, sy, gain = 1;
+			int u = x, v = y, i = remap_index(x,y);
+			int ok = x < size[n][0] && y < size[n][1];
+
+			for (int j=n-1; j >= 0 && ok; j--)  // back through the fused stages to the corrected frame
+			{
+				ok = geometry_source(st->extra[j] >> 16,st->extra[j] & 0xffff,size[j][0],size[j][1],&u,&v);
+			}
+			if (ok)
+			{
+				lens_source(st,u,v,&sx,&sy,&gain);
+				sx = round(sx*(1<<REMAP_FRAC));
+				sy = round(sy*(1<<REMAP_FRAC));
+				if (sx >= 0 && sx <= (W-1)<<REMAP_FRAC && sy >= 0 && sy <= (H-1)<<REMAP_FRAC)
+				{
+					c.x = sx;
+					c.y = sy;
+				}
+			}
+			remap_table[i] = c;
+			remap_gain[i] = clamp_int(lround(gain*(1<<REMAP_GAIN_BITS)),0,UINT16_MAX);
+		}
+	}
+	remap_key = key;
+}
+
+// lens correction of in, tile by tile: bilinear interpolation at the source positions, times the gains
+void remap(pixel out[H][W], pixel in[H][W], const stage_t *st)
+{
+	const int one = 1<<REMAP_FRAC, mask = one-1;
+	const int gain = st->param[2] != 0 || (st->file[0] && lens_grid.values == 3);
+	int t;
+
+	remap_prepare(st);
+
+	#pragma omp parallel for schedule(static)
+	for (t=0; t < REMAP_TILES_X*REMAP_TILES_Y; t++)
+	{
+		const remap_coord *c = &remap_table[t*REMAP_TILE*REMAP_TILE];
+		const uint16_t *g = &remap_gain[t*REMAP_TILE*REMAP_TILE];
+		int x0 = (t % REMAP_TILES_X)*REMAP_TILE, y0 = (t / REMAP_TILES_X)*REMAP_TILE;
+		const pixel *p;
+		int x, y, k, fx, fy, dx, dy;
+		uint32_t v;
+
+		for (y=y0; y < y0+REMAP_TILE && y < H; y++)
+		{
+			for (x=x0; x < x0+REMAP_TILE && x < W; x++)
+			{
+				k = (y-y0)*REMAP_TILE + x-x0;
+				if (c[k].x == REMAP_NONE)
+				{
+					out[y][x] = 0;
+					continue;
+				}
+				p = &in[c[k].y >> REMAP_FRAC][c[k].x >> REMAP_FRAC];
+				fx = c[k].x & mask;
+				fy = c[k].y & mask;
+				dx = (c[k].x >> REMAP_FRAC) < W-1;  // neighbours (the last row and line have none)
+				dy = (c[k].y >> REMAP_FRAC) < H-1 ? W : 0;
+				v = ((p[0]*(one-fx) + p[dx]*fx)*(one-fy) + (p[dy]*(one-fx) + p[dx+dy]*fx)*fy + (one*one>>1)) >> (2*REMAP_FRAC);
+				if (gain)
+				{
+					v = (v*g[k] + (1<<(REMAP_GAIN_BITS-1))) >> REMAP_GAIN_BITS;
+					if (v > PIXEL_MAX) v = PIXEL_MAX;
+				}
+				out[y][x] = v;
+			}
+		}
+	}
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// deadline scheduler
+// the cost of every stage is measured online (exponential average, separately for full and
+// half resolution), before a frame is processed the cost of the current quality level is
+// predicted and the level is changed according to degrade_policy
+///////////////////////////////////////////////////////////////////////////////
+
+#define SCHED_LEVELS (int)(sizeof(degrade_policy)/sizeof(degrade_policy[0]))
+#define SCHED_AVERAGE 0.2  // weight of the newest measurement
+
+typedef struct
+{
+	int skip_fir, skip_median, half_res, drop;  // quality reductions of a level
+} quality_t;
+
+typedef struct
+{
+	double cost[2][STAGES];  // average cost in ms of the stages at full [0] and half [1] resolution
+	int level;               // number of active reductions from degrade_policy
+	int good_frames;         // frames in a row with enough headroom for the better level
+	quality_t q;             // reductions of the current level
+	int enabled;             // stages enabled by the settings (bit mask of 1<<STAGE_...)
+} frame_scheduler;
+
+quality_t quality_of_level(int level)
+{
+	quality_t q = { 0, 0, 0, 0 };
+	int l;
+
+	for (l=0; l < level && l < SCHED_LEVELS; l++)
+	{
+		switch (degrade_policy[l])
+		{
+			case DEGRADE_FIR:      q.skip_fir = 1; break;
+			case DEGRADE_MEDIAN:   q.skip_median = 1; break;
+			case DEGRADE_HALF_RES: q.half_res = 1; break;
+			case DEGRADE_DROP:     q.drop = 1; break;
+		}
+	}
+	return q;
+}
+
+// record the time since t0 for a stage, returns the current time for the next stage
+double scheduler_measure(frame_scheduler *s, int stage, int half_res, double t0)
+{
+	double t = now_ms();
+	double *c = &s->cost[half_res][stage];
+
+	*c = (*c == 0) ? t-t0 : *c + SCHED_AVERAGE*((t-t0) - *c);
+	return t;
+}
+
+double scheduler_predict(const frame_scheduler *s, int level)
+{
+	quality_t q = quality_of_level(level);
+	double sum = 0, c;
+	int stage;
+
+	for (stage=0; stage < STAGES; stage++)
+	{
+		if (!(s->enabled & (1<<stage))) continue;
+		if (stage == STAGE_FIR && q.skip_fir) continue;
+		if (stage == STAGE_MEDIAN && q.skip_median) continue;
+
+		c = s->cost[0][stage];
+		if (q.half_res && stage_types[stage].kind == KIND_FILTER)
+		{
+			c = s->cost[1][stage] ? s->cost[1][stage] : c/4;  // not measured yet: a quarter of the pixels
+		}
+		sum += c;
+	}
+	return sum;
+}
+
+static void scheduler_set_level(frame_scheduler *s, int level, int frame, const char *reason)
+{
+	static const char *names[] = { "FIR Filter aus", "Median Filter aus", "halbe Aufloesung", "Bilder verwerfen" };
+
+	if (level > s->level)
+	{
+		fprintf(log_file,"Bild %d: %s, Qualitaet reduziert auf Stufe %d (%s)\n",frame,reason,level,names[degrade_policy[level-1]]);
+	}
+	else
+	{
+		fprintf(log_file,"Bild %d: %s, Qualitaet erhoeht auf Stufe %d\n",frame,reason,level);
+	}
+	s->level = level;
+	s->good_frames = 0;
+	s->q = quality_of_level(level);
+}
+
+// choose the quality level of the next frame
+void scheduler_plan(frame_scheduler *s, int frame)
+{
+	double limit = SCHED_LIMIT*FRAME_INTERVAL_MS;
+
+	while (s->level < SCHED_LEVELS && scheduler_predict(s,s->level) > limit)
+	{
+		char reason[64];
+		sprintf(reason,"%.1f msec vorhergesagt",scheduler_predict(s,s->level));
+		scheduler_set_level(s,s->level+1,frame,reason);
+	}
+	if (s->level > 0 && scheduler_predict(s,s->level-1) < SCHED_HEADROOM*FRAME_INTERVAL_MS)
+	{
+		if (++s->good_frames >= SCHED_RESTORE)
+		{
+			scheduler_set_level(s,s->level-1,frame,"genug Reserve");
+		}
+	}
+	else
+	{
+		s->good_frames = 0;
+	}
+}
+
+// check the real processing time of a frame
+void scheduler_finish(frame_scheduler *s, int frame, double time)
+{
+	char reason[64];
+
+	if (time > FRAME_INTERVAL_MS && s->level < SCHED_LEVELS)
+	{
+		sprintf(reason,"Deadline verpasst (%.1f msec)",time);
+		scheduler_set_level(s,s->level+1,frame,reason);
+	}
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// change detection for incremental processing
+// the input is compared tile by tile with the input the cached results were computed from,
+// the filters recompute the changed tiles and the tiles in their halo
+///////////////////////////////////////////////////////////////////////////////
+
+#define TILES_X ((W+TILE_SIZE-1)/TILE_SIZE)
+#define TILES_Y ((H+TILE_SIZE-1)/TILE_SIZE)
+
+typedef struct
+{
+	pixel ref[H][W];                 // input the cached results were computed from
+	uint8_t dirty[TILES_Y][TILES_X]; // changed tiles of the last comparison
+	int count;                       // number of changed tiles
+	int valid;                       // reference is initialized
+} change_detector;
+
+// compare a tile with the reference (memcmp and the SAD loop are vectorized by libc/compiler)
+static int tile_changed(pixel in[H][W], pixel ref[H][W], int x0, int y0, int x1, int y1)
+{
+	int x,y;
+	unsigned int sad = 0;
+
+	for (y=y0; y < y1; y++)  // loop over all lines of the tile
+	{
+		if (TILE_THRESHOLD == 0)
+		{
+			if (memcmp(&in[y][x0],&ref[y][x0],(x1-x0)*sizeof(pixel)) != 0) return 1;
+		}
+		else
+		{
+			for (x=x0; x < x1; x++) sad += abs(in[y][x] - ref[y][x]);
+		}
+	}
+	return sad > (unsigned int)(TILE_THRESHOLD*(1<<PIXEL_SHIFT)*(x1-x0)*(y1-y0));
+}
+
+// mark the changed tiles and update the reference, returns the number of changed tiles
+int detect_changes(change_detector *d, pixel in[H][W])
+{
+	int tx,ty,y,x0,y0,x1,y1;
+
+	d->count = 0;
+	for (ty=0; ty < TILES_Y; ty++)
+	{
+		for (tx=0; tx < TILES_X; tx++)
+		{
+			x0 = tx*TILE_SIZE;
+			y0 = ty*TILE_SIZE;
+			x1 = x0+TILE_SIZE < W ? x0+TILE_SIZE : W;
+			y1 = y0+TILE_SIZE < H ? y0+TILE_SIZE : H;
+
+			d->dirty[ty][tx] = !d->valid || tile_changed(in,d->ref,x0,y0,x1,y1);
+			if (d->dirty[ty][tx])
+			{
+				for (y=y0; y < y1; y++)
+				{
+					memcpy(&d->ref[y][x0],&in[y][x0],(x1-x0)*sizeof(pixel));
+				}
+				d->count++;
+			}
+		}
+	}
+	d->valid = 1;
+	return d->count;
+}
+
+// tiles a filter has to compute again: the changed ones and n neighbours (halo <= n*TILE_SIZE)
+void dilate_tiles(uint8_t out[TILES_Y][TILES_X], uint8_t in[TILES_Y][TILES_X], int n)
+{
+	int tx,ty,dx,dy;
+
+	memset(out,0,TILES_Y*TILES_X);
+	for (ty=0; ty < TILES_Y; ty++)
+	{
+		for (tx=0; tx < TILES_X; tx++)
+		{
+			if (!in[ty][tx]) continue;
+			for (dy=-n; dy <= n; dy++)
+			{
+				for (dx=-n; dx <= n; dx++)
+				{
+					if (ty+dy >= 0 && ty+dy < TILES_Y && tx+dx >= 0 && tx+dx < TILES_X)
+					{
+						out[ty+dy][tx+dx] = 1;
+					}
+				}
+			}
+		}
+	}
+}
+
+// apply a filter to the marked tiles only, neighbouring marked tiles of a line are one region,
+// nothing outside of the region of the stage is computed
+long filter_tiles(const stage_t *st, pixel out[H][W], pixel in[H][W], uint8_t mask[TILES_Y][TILES_X])  // returns the filtered pixels
+{
+	const int *roi = st->roi;
+	int tx,ty,start,x0,y0,x1,y1;
+	long pixels = 0;
+
+	for (ty=0; ty < TILES_Y; ty++)
+	{
+		for (tx=0; tx < TILES_X; tx++)
+		{
+			if (!mask[ty][tx]) continue;
+			for (start=tx; tx < TILES_X && mask[ty][tx]; tx++);  // run of marked tiles
+			x0 = start*TILE_SIZE > roi[0] ? start*TILE_SIZE : roi[0];
+			y0 = ty*TILE_SIZE > roi[1] ? ty*TILE_SIZE : roi[1];
+			x1 = tx*TILE_SIZE < roi[2] ? tx*TILE_SIZE : roi[2];
+			y1 = (ty+1)*TILE_SIZE < roi[3] ? (ty+1)*TILE_SIZE : roi[3];
+			if (x0 < x1 && y0 < y1)
+			{
+				stage_types[st->type].filter(W,H,out,in,x0,y0,x1,y1,st->param);
+				pixels += (long)(x1-x0)*(y1-y0);
+			}
+		}
+	}
+	return pixels;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// cache of the stage results
+// every stage keeps its last result together with a key (hash of its parameters and of the
+// parameters of all stages before it) and the id of the input frame, the processing resumes
+// at the first stage whose key or input changed
+///////////////////////////////////////////////////////////////////////////////
+
+enum { CACHE_REUSE, CACHE_UPDATE, CACHE_COMPUTE };
+
+typedef struct
+{
+	uint32_t key;        // hash of the parameters of this and all previous stages
+	unsigned long frame; // id of the input frame (changes only if the content of the input changes)
+	int valid;
+} stage_cache;
+
+uint32_t hash_params(uint32_t key, const void *data, size_t n)  // FNV-1a
+{
+	const uint8_t *p = data;
+	size_t i;
+
+	if (key == 0) key = 2166136261u;
+	for (i=0; i < n; i++)
+	{
+		key = (key ^ p[i]) * 16777619u;
+	}
+	return key;
+}
+
+// decide how a stage gets its result: reuse it, update the changed tiles (if possible) or compute it
+int cache_lookup(stage_cache *c, uint32_t key, unsigned long frame, int can_update)
+{
+	int action = CACHE_COMPUTE;
+
+	if (c->valid && c->key == key)
+	{
+		if (c->frame == frame)
+		{
+			return CACHE_REUSE;
+		}
+		if (can_update && c->frame+1 == frame)  // result of the previous input, the changed tiles are known
+		{
+			action = CACHE_UPDATE;
+		}
+	}
+	c->valid = 1;
+	c->key = key;
+	c->frame = frame;
+	return action;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// hardware performance counters per stage
+// the counters of the calling thread form one group, so they are read with one system call;
+// without counters (not compiled in, not allowed, no PMU in a virtual machine) the functions do nothing;
+// the probes around the stages also record them in the timeline trace
+///////////////////////////////////////////////////////////////////////////////
+
+enum { CNT_CYCLES, CNT_INSTRUCTIONS, CNT_L1_MISSES, CNT_LLC_MISSES, CNT_BRANCH_MISSES, COUNTERS };
+
+typedef struct
+{
+	uint64_t value[COUNTERS];  // sums of all calls
+	uint64_t pixels;
+} stage_counters;
+
+STREAM_LOCAL stage_counters counter_sums[STAGES];
+STREAM_LOCAL int counter_fd = -1;               // group leader (cycles)
+STREAM_LOCAL int counter_slot[COUNTERS];        // position in the group (-1: not available)
+STREAM_LOCAL int counter_group = 0;             // counters in the group
+
+void counters_open()
+{
+#if defined(STAGE_COUNTERS) && defined(__linux__)
+	static const struct { uint32_t type; uint64_t config; const char *name; } events[COUNTERS] =
+	{
+		[CNT_CYCLES]        = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES,    "cycles" },
+		[CNT_INSTRUCTIONS]  = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS,  "instructions" },
+		[CNT_L1_MISSES]     = { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16, "L1 data misses" },
+		[CNT_LLC_MISSES]    = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES,  "last level cache misses" },
+		[CNT_BRANCH_MISSES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "branch misses" },
+	};
+	struct perf_event_attr attr;
+	int i, fd;
+
+	if (counter_fd >= 0)
+	{
+		return;
+	}
+	for (i=0; i < COUNTERS; i++)
+	{
+		memset(&attr,0,sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = events[i].type;
+		attr.config = events[i].config;
+		attr.read_format = PERF_FORMAT_GROUP;
+		attr.disabled = (counter_fd < 0);  // the group is started with its leader
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		counter_slot[i] = -1;
+		fd = syscall(SYS_perf_event_open,&attr,0,-1,counter_fd,0);  // this thread, any cpu
+		if (fd < 0)
+		{
+			fprintf(log_file,"performance counter %s not available (%s)\n",events[i].name,strerror(errno));
+			if (i == CNT_CYCLES)
+			{
+				fprintf(log_file,"no performance counters (see /proc/sys/kernel/perf_event_paranoid)\n");
+				return;
+			}
+			continue;
+		}
+		if (counter_fd < 0)
+		{
+			counter_fd = fd;
+		}
+		counter_slot[i] = counter_group++;
+	}
+	ioctl(counter_fd,PERF_EVENT_IOC_ENABLE,PERF_IOC_FLAG_GROUP);
+#endif
+}
+
+static void counters_read(uint64_t v[COUNTERS])
+{
+	uint64_t data[1+COUNTERS];  // number of counters and their values
+	int i;
+
+	if (read(counter_fd,data,sizeof(data)) != (ssize_t)((1+counter_group)*sizeof(uint64_t)))
+	{
+		memset(v,0,COUNTERS*sizeof(uint64_t));
+		return;
+	}
+	for (i=0; i < COUNTERS; i++)
+	{
+		v[i] = counter_slot[i] >= 0 ? data[1+counter_slot[i]] : 0;
+	}
+}
+
+typedef struct
+{
+	uint64_t counter[COUNTERS];  // performance counters at the start of a stage
+	double begin;                // trace time stamp
+} stage_probe;
+
+void probe_begin(stage_probe *p)
+{
+	if (counter_fd >= 0) counters_read(p->counter);
+	p->begin = trace_begin();
+}
+
+void probe_end(int stage, const stage_probe *p, long pixels)  // add to the sums of the stage and trace it
+{
+	uint64_t now[COUNTERS];
+	int i;
+
+	trace_end(stage_types[stage].name,p->begin);
+	if (counter_fd < 0)
+	{
+		return;
+	}
+	counters_read(now);
+	for (i=0; i < COUNTERS; i++)
+	{
+		counter_sums[stage].value[i] += now[i] - p->counter[i];
+	}
+	counter_sums[stage].pixels += pixels;
+}
+
+void counters_report(FILE *f)
+{
+	const stage_counters *c;
+	double pixels;
+	int stage, i;
+
+	if (counter_fd < 0)
+	{
+		return;
+	}
+	fprintf(f,"%-12s %9s %12s %6s %12s %12s %12s\n","stage","Mpixel","cycles/pix","IPC","L1 miss/pix","LLC miss/pix","br.miss/pix");
+	for (stage=0; stage < STAGES; stage++)
+	{
+		c = &counter_sums[stage];
+		if (c->pixels == 0) continue;
+		pixels = c->pixels;
+		fprintf(f,"%-12s %9.1f %12.2f %6.2f",stage_types[stage].name,pixels/1e6,c->value[CNT_CYCLES]/pixels,
+		        c->value[CNT_CYCLES] ? (double)c->value[CNT_INSTRUCTIONS]/c->value[CNT_CYCLES] : 0);
+		for (i=CNT_L1_MISSES; i <= CNT_BRANCH_MISSES; i++)
+		{
+			if (counter_slot[i] >= 0) fprintf(f," %12.4f",c->value[i]/pixels);
+			else                      fprintf(f," %12s","-");
+		}
+		fputc('\n',f);
+	}
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// shared worker pool of the streams (see MULTI_STREAM)
+// a filter is cut into bands of BAND_LINES lines, the stream computes its bands from the end of its queue and
+// the workers steal them from the front, always from the stream that got the smallest share of the pool so far
+// (the time of its stolen bands divided by its priority); one lock for all queues, the bands are coarse
+///////////////////////////////////////////////////////////////////////////////
+
+#ifdef MULTI_STREAM
+#define MAX_BANDS ((H+BAND_LINES-1)/BAND_LINES)
+
+typedef struct
+{
+	region_filter filter;
+	int width, height;
+	pixel *out, *in;
+	int x0, y0, x1, y1;
+	const int *param;
+	long frame;        // for the trace
+} band_task;
+
+typedef struct
+{
+	band_task task[MAX_BANDS];  // bands of the current filter of the stream, front <= i < end are waiting
+	int front, end;
+	int unfinished;             // bands waiting or being computed
+	int priority;               // shares of the pool
+	double served;              // msec of stolen bands / priority
+	pthread_cond_t done;        // the last band is computed
+} band_queue;
+
+band_queue band_queues[STREAMS];
+STREAM_LOCAL band_queue *own_queue = NULL;             // queue of the stream of this thread (NULL: no pool)
+pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t pool_wake = PTHREAD_COND_INITIALIZER;   // there are new bands
+
+static void run_band(const band_task *b)
+{
+	double t = trace_begin();
+
+	b->filter(b->width,b->height,(pixel (*)[W])b->out,(pixel (*)[W])b->in,b->x0,b->y0,b->x1,b->y1,b->param);
+	trace_end("band",t);
+}
+
+// queue with waiting bands and the smallest share of the pool, called with pool_lock
+static band_queue *pool_victim()
+{
+	band_queue *q = NULL;
+	int k;
+
+	for (k=0; k < STREAMS; k++)
+	{
+		if (band_queues[k].front < band_queues[k].end && (q == NULL || band_queues[k].served < q->served))
+		{
+			q = &band_queues[k];
+		}
+	}
+	return q;
+}
+
+static void *pool_worker(void *arg)
+{
+	band_queue *q;
+	band_task b;
+	double t;
+
+	(void)arg;
+	pthread_mutex_lock(&pool_lock);
+	for (;;)
+	{
+		while ((q = pool_victim()) == NULL)
+		{
+			pthread_cond_wait(&pool_wake,&pool_lock);
+		}
+		b = q->task[q->front++];
+		pthread_mutex_unlock(&pool_lock);
+		trace_frame = b.frame;
+		t = now_ms();
+		run_band(&b);
+		t = now_ms() - t;
+		pthread_mutex_lock(&pool_lock);
+		q->served += t / q->priority;
+		if (--q->unfinished == 0)
+		{
+			pthread_cond_signal(&q->done);
+		}
+	}
+	return NULL;
+}
+
+void start_pool()
+{
+	pthread_t worker;
+	int k, n = POOL_WORKERS > 0 ? POOL_WORKERS : (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+	for (k=0; k < STREAMS; k++)
+	{
+		band_queues[k].priority = streams[k].priority > 0 ? streams[k].priority : 1;
+		pthread_cond_init(&band_queues[k].done,NULL);
+	}
+	for (k=0; k < n; k++)
+	{
+		if (pthread_create(&worker,NULL,pool_worker,NULL) != 0)
+		{
+			fprintf(log_file,"Error starting worker threads ==> exit.\n");
+			exit(-1);
+		}
+		pthread_detach(worker);
+	}
+	fprintf(log_file,"%d streams, %d worker threads\n",STREAMS,n);
+}
+#endif
+
+// compute the pixels x0 <= x < x1, y0 <= y < y1 of a filter, in bands with the pool if this thread has a stream
+// (the kernels of a stream are not shared, the stream computes them alone)
+void filter_bands(int type, int width, int height, pixel *out, pixel *in, int x0, int y0, int x1, int y1, const int param[])
+{
+#ifdef MULTI_STREAM
+	band_queue *q = own_queue, *busy;
+	band_task b = { stage_types[type].filter, width, height, out, in, x0, y0, x1, y1, param, trace_frame };
+	int y;
+
+	if (q == NULL || type == STAGE_KERNEL || y1-y0 <= BAND_LINES)
+	{
+		run_band(&b);
+		return;
+	}
+	pthread_mutex_lock(&pool_lock);
+	if ((busy = pool_victim()) != NULL && q->served < busy->served)  // no credit for the time without bands
+	{
+		q->served = busy->served;
+	}
+	q->front = q->end = 0;
+	for (y=y0; y < y1; y+=BAND_LINES)
+	{
+		b.y0 = y;
+		b.y1 = y+BAND_LINES < y1 ? y+BAND_LINES : y1;
+		q->task[q->end++] = b;
+	}
+	q->unfinished = q->end;
+	pthread_cond_broadcast(&pool_wake);
+	while (q->front < q->end)  // the stream does not wait for the pool
+	{
+		b = q->task[--q->end];
+		pthread_mutex_unlock(&pool_lock);
+		run_band(&b);
+		pthread_mutex_lock(&pool_lock);
+		q->unfinished--;
+	}
+	while (q->unfinished > 0)
+	{
+		pthread_cond_wait(&q->done,&pool_lock);
+	}
+	pthread_mutex_unlock(&pool_lock);
+#else
+	stage_types[type].filter(width,height,(pixel (*)[W])out,(pixel (*)[W])in,x0,y0,x1,y1,param);
+#endif
+}
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+
+///////////////////////////////////////////////////////////////////////////////
+// execution of a plan
+// every position of the plan has its own result buffer and cache entry, zoom and flips only
+// change the view of the previous result, a stage that needs a buffer materializes the view
+///////////////////////////////////////////////////////////////////////////////
+
+STREAM_LOCAL pixel inp[H][W], scratch[2][H][W];            // input image and materialized views
+STREAM_LOCAL pixel half_inp[H/2][W/2];                     // input for processing with half resolution
+STREAM_LOCAL pixel *stage_buffer[2][MAX_STAGES];           // results of the stages at full [0] and half [1] resolution
+STREAM_LOCAL uint32_t buffer_stage[2][MAX_STAGES];         // hash of the stage that wrote the buffer
+STREAM_LOCAL stage_cache cache[MAX_STAGES];                // keys of the results
+STREAM_LOCAL change_detector changes;                      // reference input for incremental processing
+STREAM_LOCAL uint8_t stage_tiles[2][TILES_Y][TILES_X];     // tiles the current filter has to compute again
+STREAM_LOCAL exposure_ctrl exposure = { EXPOSURE_MANUAL }; // state of the automatic exposure control
+
+// result buffer of the position i of the plan for the stage st (NULL: only allocated), the filters do not write
+// their border, so the buffer is cleared when another stage moves to this position (as a new buffer)
+static pixel *buffer_of_stage(int i, int half_res, const stage_t *st)
+{
+	uint32_t key;
+
+	if (stage_buffer[half_res][i] == NULL)  // allocated when a plan uses this position the first time
+	{
+		stage_buffer[half_res][i] = calloc(H*W,sizeof(pixel));
+		if (stage_buffer[half_res][i] == NULL)
+		{
+			fprintf(log_file,"Error allocating memory ==> exit.\n");
+			exit(-1);
+		}
+	}
+	if (st != NULL && (key = hash_params(0,st,sizeof(*st))) != buffer_stage[half_res][i])
+	{
+		memset(stage_buffer[half_res][i],0,H*W*sizeof(pixel));
+		buffer_stage[half_res][i] = key;
+	}
+	return stage_buffer[half_res][i];
+}
+
+static img_view materialize(img_view v)  // copy a view into the scratch buffer it does not read from
+{
+	pixel (*buffer)[W] = scratch[v.base >= &scratch[0][0][0] && v.base < &scratch[1][0][0]];
+
+	view_to_image(buffer,v);
+	return view_image(buffer);
+}
+
+static int skipped(const frame_scheduler *s, const stage_t *st)
+{
+	return (st->type == STAGE_FIR && s->q.skip_fir) || (st->type == STAGE_MEDIAN && s->q.skip_median);
+}
+
+// is history the result of the temporal stage i of this plan for the previous frame? (it is for the next one)
+// the plan is identified by its address and the stages up to i
+int temporal_begin(const pipeline_t *plan, int i)
+{
+	uint32_t key = hash_params(hash_params(0,&plan,sizeof(plan)),plan->stage,(i+1)*sizeof(stage_t));
+	int valid = key == history_key;
+
+	history_key = key;
+	history_runs++;
+	return valid;
+}
+
+// process the input with the plan, returns the view of the result
+// (incremental: the changed tiles of the input are marked in changes.dirty)
+static void brightness_lut(pixel lut[PIXEL_MAX+1], const stage_t *st)
+{
+	int k, v, z;
+
+	exposure_lut(lut,&exposure,st->param[0]);  // table from the statistics of the previous frame
+	for (k=0; k < st->extras; k++)              // fused brightness stages
+	{
+		for (v=0; v <= PIXEL_MAX; v++)
+		{
+			z = lut[v] + st->extra[k]*(1<<PIXEL_SHIFT);
+			lut[v] = z < 0 ? 0 : z > PIXEL_MAX ? PIXEL_MAX : z;
+		}
+	}
+}
+
+img_view execute_plan(const pipeline_t *plan, frame_scheduler *s, pixel in[H][W], unsigned long frame_id, int incremental)
+{
+	const stage_t *st;
+	const stage_info *info;
+	img_view view = view_image(in);
+	img_stats stats;                 // statistics of the current frame
+	pixel lut[PIXEL_MAX+1];          // table of the brightness change
+	uint16_t weights[256];           // table of the temporal denoising
+	pixel *dst;
+	uint8_t (*mask)[TILES_X] = changes.dirty;
+	uint32_t key;
+	stage_probe probe;               // performance counters and trace of a stage
+	int i, angle, half_res = 0, first = 0;
+	int width = W, height = H;       // size of the images (smaller than the frame with half resolution)
+	double t;
+
+	while (first < plan->count && skipped(s,&plan->stage[first])) first++;
+	if (s->q.half_res && first < plan->count && stage_types[plan->stage[first].type].kind == KIND_FILTER)
+	{
+		view = view_buffer((pixel *)half_inp,W/2,H/2);  // filter with half resolution, the view enlarges it again
+		width = W/2;
+		height = H/2;
+		half_res = 1;
+	}
+	key = hash_params(0,&width,sizeof(width));
+
+	for (i=0; i < plan->count; i++)
+	{
+		st = &plan->stage[i];
+		info = &stage_types[st->type];
+		if (skipped(s,st)) continue;
+		key = hash_params(key,st,sizeof(*st));
+
+		if (info->kind == KIND_FILTER)
+		{
+			if (view.line_stride != width || view.pixel_stride != 1 || view.zoom != 1 || view.width != width || view.height != height)
+			{
+				view = materialize(view);  // the filters need a buffer
+				incremental = 0;
+			}
+			dilate_tiles(stage_tiles[mask == stage_tiles[0]],mask,(stage_halo(st)+TILE_SIZE-1)/TILE_SIZE);  // halo of this filter
+			mask = stage_tiles[mask == stage_tiles[0]];
+			dst = buffer_of_stage(i,half_res,st);
+			switch (cache_lookup(&cache[i],key,frame_id,incremental && !half_res))
+			{
+				case CACHE_UPDATE:
+					probe_begin(&probe);
+					probe_end(st->type,&probe,filter_tiles(st,(pixel (*)[W])dst,(pixel (*)[W])view.base,mask));
+					break;
+				case CACHE_COMPUTE:
+					t = now_ms();
+					probe_begin(&probe);
+					if (view.base == (pixel *)half_inp) downscale2(W,H,half_inp,in);
+					if (half_res)
+					{
+						filter_bands(st->type,width,height,dst,view.base,0,0,width,height,st->param);
+					}
+					else
+					{
+						filter_bands(st->type,W,H,dst,view.base,st->roi[0],st->roi[1],st->roi[2],st->roi[3],st->param);
+					}
+					scheduler_measure(s,st->type,half_res,t);
+					probe_end(st->type,&probe,half_res ? (long)width*height : (long)(st->roi[2]-st->roi[0])*(st->roi[3]-st->roi[1]));
+					incremental = 0;  // the following stages have to be computed completely
+					break;
+			}
+			view = view_buffer(dst,width,height);
+			continue;
+		}
+
+		incremental = 0;  // the changed tiles are not known behind geometric and point operations
+		if (width != W && st->type != STAGE_ZOOM)  // end of the filters with half resolution
+		{
+			view = view_scale(view,W/width);
+			width = W;
+			height = H;
+		}
+		switch (st->type)
+		{
+			case STAGE_ZOOM:
+				if (view.zoom != 1 && width == W)
+				{
+					view = materialize(view);  // zoom of a zoomed image
+				}
+				view = view_zoom(view,st->param[0]);
+				if (width != W)
+				{
+					view = view_scale(view,W/width);
+					width = W;
+					height = H;
+				}
+				break;
+
+			case STAGE_FLIP:
+				if (st->param[0] & 1) view = view_flip_horizontal(view);
+				if (st->param[0] & 2) view = view_flip_vertical(view);
+				break;
+
+			case STAGE_BRIGHTNESS:  // flips and zoom before it are folded into its read
+				brightness_lut(lut,st);
+				key = hash_params(key,lut,sizeof(lut));
+				dst = buffer_of_stage(i,0,st);
+				if (cache_lookup(&cache[i],key,frame_id,0) == CACHE_COMPUTE)
+				{
+					t = now_ms();
+					probe_begin(&probe);
+					change_brightness((pixel (*)[W])dst,view,lut,st->param[1] != EXPOSURE_MANUAL ? &stats : NULL);
+					if (st->param[1] != EXPOSURE_MANUAL)
+					{
+						exposure_update(&exposure,&stats);
+					}
+					scheduler_measure(s,STAGE_BRIGHTNESS,0,t);
+					probe_end(STAGE_BRIGHTNESS,&probe,W*H);
+				}
+				view = view_image((pixel (*)[W])dst);
+				break;
+
+			case STAGE_TEMPORAL:  // computed for every frame, the result depends on the previous ones
+				temporal_weights(weights,st->param);
+				t = now_ms();
+				probe_begin(&probe);
+				temporal_filter(view,weights,temporal_begin(plan,i));
+				scheduler_measure(s,STAGE_TEMPORAL,0,t);
+				probe_end(STAGE_TEMPORAL,&probe,W*H);
+				key = hash_params(key,&history_runs,sizeof(history_runs));
+				view = view_image(history);
+				break;
+
+			case STAGE_ROTATION:
+				angle = ((st->param[0] % 360) + 360) % 360;
+				if (angle == 180 && view.width == W && view.height == H)
+				{
+					view = view_flip_vertical(view_flip_horizontal(view));
+					break;
+				}
+				dst = buffer_of_stage(i,0,st);
+				if (cache_lookup(&cache[i],key,frame_id,0) == CACHE_COMPUTE)
+				{
+					t = now_ms();
+					probe_begin(&probe);
+					if (!view_is_image(view))
+					{
+						view = materialize(view);  // zoom/flip
+					}
+					rotation((pixel (*)[W])dst,(pixel (*)[W])view.base,angle);
+					scheduler_measure(s,STAGE_ROTATION,0,t);
+					probe_end(STAGE_ROTATION,&probe,W*H);
+				}
+				view = view_image((pixel (*)[W])dst);
+				break;
+
+			case STAGE_REMAP:  // with the views and rotations behind it in one pass
+				dst = buffer_of_stage(i,0,st);
+				if (cache_lookup(&cache[i],key,frame_id,0) == CACHE_COMPUTE)
+				{
+					t = now_ms();
+					probe_begin(&probe);
+					if (!view_is_image(view))
+					{
+						view = materialize(view);  // zoom/flip
+					}
+					remap((pixel (*)[W])dst,(pixel (*)[W])view.base,st);
+					scheduler_measure(s,STAGE_REMAP,0,t);
+					probe_end(STAGE_REMAP,&probe,W*H);
+				}
+				view = view_image((pixel (*)[W])dst);
+				break;
+		}
+	}
+	if (width != W)  // plan of filters only
+	{
+		view = view_scale(view,W/width);
+	}
+	return view;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// slice streaming
+// the input is read in slices of SLICE_LINES lines, after every slice each stage processes the lines
+// whose input lines (plus the halo of a filter) are complete and the finished lines are written;
+// other plans, half resolution and dropped frames of the scheduler use the whole frame
+///////////////////////////////////////////////////////////////////////////////
+
+int can_stream(const pipeline_t *plan, const frame_scheduler *s)
+{
+	const stage_t *st;
+	int i, auto_exposure = 0;
+
+	if (input.format != INPUT_RAW || s->q.half_res || s->q.drop)
+	{
+		return 0;
+	}
+	for (i=0; i < plan->count; i++)
+	{
+		st = &plan->stage[i];
+		if (st->type == STAGE_BRIGHTNESS && st->param[1] != EXPOSURE_MANUAL && auto_exposure++) return 0;  // one statistic per frame
+		if (stage_types[st->type].kind != KIND_FILTER && stage_types[st->type].kind != KIND_POINT && !(st->type == STAGE_FLIP && st->param[0] == 1)) return 0;
+	}
+	return 1;
+}
+
+// read, process and write (if output is set) one frame in slices, returns 0 at the end of the input
+int stream_frame(const pipeline_t *plan, frame_scheduler *s, FILE *in_file, int output)
+{
+	static STREAM_LOCAL pixel lut[MAX_STAGES][PIXEL_MAX+1];
+	uint16_t weights[256];             // table of the temporal denoising
+	int valid = 0;                     // history holds the previous result of the temporal stage
+	const stage_t *st;
+	const pixel *src[MAX_STAGES+1];    // input of stage i, src[i+1] its result
+	int done[MAX_STAGES+1];            // complete lines of src[i]
+	double spent[MAX_STAGES+1];        // time of the stages and of the output
+	uint32_t sub[4][256];              // histogram for the auto exposure
+	img_stats stats;
+	stage_probe probe;
+	int i, j, y, y1, ready, written = 0, counted = -1;
+	double t;
+
+	src[0] = &inp[0][0];
+	for (i=0; i < plan->count; i++)
+	{
+		st = &plan->stage[i];
+		src[i+1] = skipped(s,st) ? src[i] : buffer_of_stage(i,0,st);
+		if (st->type == STAGE_BRIGHTNESS)
+		{
+			brightness_lut(lut[i],st);
+			if (st->param[1] != EXPOSURE_MANUAL) counted = i;
+		}
+		else if (st->type == STAGE_TEMPORAL)
+		{
+			src[i+1] = &history[0][0];
+			temporal_weights(weights,st->param);
+			valid = temporal_begin(plan,i);
+		}
+	}
+	memset(done,0,sizeof(done));
+	memset(spent,0,sizeof(spent));
+	memset(sub,0,sizeof(sub));
+	if (output) begin_outputs();
+
+	for (y=0; y < H; y=y1)
+	{
+		y1 = y+SLICE_LINES < H ? y+SLICE_LINES : H;
+		t = trace_begin();
+		if (!read_raw_lines(inp,y,y1,in_file))
+		{
+			fprintf(log_file,"no more data in input image\n");
+			return 0;
+		}
+		trace_end("read",t);
+		done[0] = y1;
+		for (i=0; i < plan->count; i++)
+		{
+			st = &plan->stage[i];
+			if (skipped(s,st))
+			{
+				done[i+1] = done[i];
+				continue;
+			}
+			ready = stage_types[st->type].kind == KIND_FILTER && done[i] < H ? done[i] - stage_halo(st) : done[i];
+			if (ready <= done[i+1]) continue;  // waits for more input lines
+			t = now_ms();
+			probe_begin(&probe);
+			if (stage_types[st->type].kind == KIND_FILTER)
+			{
+				stage_types[st->type].filter(W,H,(pixel (*)[W])src[i+1],(pixel (*)[W])src[i],0,done[i+1],W,ready,st->param);
+			}
+			for (j=done[i+1]; j < ready; j++)
+			{
+				if (st->type == STAGE_BRIGHTNESS)
+				{
+					brightness_line((pixel *)src[i+1] + j*W,src[i] + j*W,W,lut[i],sub,i == counted ? W : 0);
+				}
+				else if (st->type == STAGE_FLIP)
+				{
+					reverse_line((pixel *)src[i+1] + j*W,src[i] + j*W,W);
+				}
+				else if (st->type == STAGE_TEMPORAL && valid)
+				{
+					temporal_line(history[j],src[i] + j*W,W,weights);
+				}
+				else if (st->type == STAGE_TEMPORAL)
+				{
+					memcpy(history[j],src[i] + j*W,sizeof(history[j]));
+				}
+			}
+			spent[i] += now_ms() - t;
+			probe_end(st->type,&probe,(long)(ready-done[i+1])*W);
+			done[i+1] = ready;
+		}
+		if (output && done[plan->count] > written)  // finished lines at once
+		{
+			t = now_ms();
+			probe_begin(&probe);
+			write_output_lines(view_buffer((pixel *)src[plan->count],W,H),written,done[plan->count]);
+			for (i=0; i < OUTPUTS; i++)
+			{
+				fflush(outputs[i].file);
+			}
+			probe_end(STAGE_OUTPUT,&probe,(long)(done[plan->count]-written)*W);
+			written = done[plan->count];
+			spent[plan->count] += now_ms() - t;
+		}
+	}
+	if (!read_chroma(in_file))
+	{
+		fprintf(log_file,"no more data in input image\n");
+		return 0;
+	}
+	if (output) end_outputs();
+
+	if (counted >= 0)  // statistics for the next frame
+	{
+		for (i=0; i < 256; i++)
+		{
+			stats.hist[i] = sub[0][i] + sub[1][i] + sub[2][i] + sub[3][i];
+		}
+		finish_stats(&stats);
+		exposure_update(&exposure,&stats);
+	}
+	for (i=0; i < plan->count; i++)
+	{
+		if (!skipped(s,&plan->stage[i])) scheduler_measure(s,plan->stage[i].type,0,now_ms() - spent[i]);
+	}
+	scheduler_measure(s,STAGE_OUTPUT,0,now_ms() - spent[plan->count]);
+	return 1;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// real-time mode and jitter measurement
+///////////////////////////////////////////////////////////////////////////////
+
+#define RT_WORKERS (int)(sizeof(rt_worker_cores)/sizeof(rt_worker_cores[0]))
+
+static void rt_thread(int core, int priority)  // pin the calling thread and set its priority
+{
+	struct sched_param param = { .sched_priority = priority };
+	cpu_set_t cpus;
+
+	if (core >= 0)
+	{
+		CPU_ZERO(&cpus);
+		CPU_SET(core,&cpus);
+		if (sched_setaffinity(0,sizeof(cpus),&cpus) != 0)
+		{
+			fprintf(stderr,"real-time mode: core %d is not available (%s) ==> exit.\n",core,strerror(errno));
+			exit(-1);
+		}
+	}
+	if (sched_setscheduler(0,RT_POLICY,&param) != 0)
+	{
+		fprintf(stderr,"real-time mode: priority %d not allowed (%s), run as root, with CAP_SYS_NICE "
+		               "or an rtprio limit in /etc/security/limits.conf ==> exit.\n",priority,strerror(errno));
+		exit(-1);
+	}
+}
+
+static void prefault_stack()
+{
+	volatile uint8_t stack[RT_STACK_PREFAULT];
+	size_t i;
+
+	for (i=0; i < sizeof(stack); i+=4096)
+	{
+		stack[i] = 0;
+	}
+}
+
+// lock and touch the memory, then give the threads their cores and priorities (before the first frame)
+void realtime_setup()
+{
+	int i;
+
+	mallopt(M_TRIM_THRESHOLD,-1);  // freed memory stays in the process
+	mallopt(M_MMAP_MAX,0);         // large buffers from the (locked) heap
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+	{
+		fprintf(stderr,"real-time mode: memory cannot be locked (%s), run as root, with CAP_IPC_LOCK "
+		               "or a larger memlock limit (ulimit -l) ==> exit.\n",strerror(errno));
+		exit(-1);
+	}
+	for (i=0; i < MAX_STAGES; i++)  // all buffers a plan can use
+	{
+		memset(buffer_of_stage(i,0,NULL),0,W*H*sizeof(pixel));
+		memset(buffer_of_stage(i,1,NULL),0,W*H*sizeof(pixel));
+	}
+	prefault_stack();
+
+	rt_thread(rt_io_core,RT_IO_PRIORITY);
+#ifdef _OPENMP
+	omp_set_num_threads(1 + RT_WORKERS);
+	#pragma omp parallel  // the threads stay for the following parallel regions
+	{
+		if (omp_get_thread_num() > 0)
+		{
+			rt_thread(rt_worker_cores[(omp_get_thread_num()-1) % RT_WORKERS],RT_WORKER_PRIORITY);
+			prefault_stack();
+		}
+	}
+#endif
+	fprintf(log_file,"real-time mode: policy %d, priority %d/%d, %d worker cores, memory locked\n",
+	        RT_POLICY,RT_IO_PRIORITY,RT_WORKER_PRIORITY,RT_WORKERS);
+}
+
+typedef struct
+{
+	uint32_t bin[JITTER_BINS];  // deviations of the frame intervals
+	uint32_t count;
+	double last;                // time of the last frame
+	double sum, sum2, min, max; // of the intervals
+} jitter_stats;
+
+void jitter_add(jitter_stats *j, double t)  // a frame is finished at time t
+{
+	double interval = t - j->last;
+	int bin;
+
+	if (j->last > 0)
+	{
+		bin = (int)floor((interval - FRAME_INTERVAL_MS)/JITTER_BIN_MS + 0.5) + JITTER_BINS/2;
+		j->bin[bin < 0 ? 0 : bin >= JITTER_BINS ? JITTER_BINS-1 : bin]++;
+		j->min = (j->count == 0 || interval < j->min) ? interval : j->min;
+		j->max = (j->count == 0 || interval > j->max) ? interval : j->max;
+		j->sum += interval;
+		j->sum2 += interval*interval;
+		j->count++;
+	}
+	j->last = t;
+}
+
+void jitter_report(FILE *f, const jitter_stats *j)
+{
+	double mean;
+	uint32_t most = 0;
+	int i;
+
+	if (j->count == 0)
+	{
+		return;
+	}
+	mean = j->sum / j->count;
+	fprintf(f,"frame intervals: %u, mean %.2f msec, std. deviation %.2f msec, min %.2f, max %.2f\n",j->count,mean,
+	        sqrt(j->sum2/j->count - mean*mean > 0 ? j->sum2/j->count - mean*mean : 0),j->min,j->max);
+	for (i=0; i < JITTER_BINS; i++)
+	{
+		most = j->bin[i] > most ? j->bin[i] : most;
+	}
+	fprintf(f,"deviation from %.1f msec:\n",FRAME_INTERVAL_MS);
+	for (i=0; i < JITTER_BINS; i++)
+	{
+		if (j->bin[i] == 0) continue;
+		fprintf(f,"%s%+6.1f msec %7u ",i == 0 ? "<=" : i == JITTER_BINS-1 ? ">=" : "  ",(i - JITTER_BINS/2)*JITTER_BIN_MS,j->bin[i]);
+		for (int k=0; k < (int)(50.0*j->bin[i]/most + 0.5); k++) fputc('#',f);
+		fputc('\n',f);
+	}
+}
+
+
+// plan the stages read from the settings
+static void apply_settings(const pipeline_t *pipeline, pipeline_t *plan, frame_scheduler *scheduler)
+{
+	int mode;                // exposure mode of the plan
+
+	plan_pipeline(plan,pipeline);
+	
+	mode = EXPOSURE_MANUAL;
+	for (int k=0; k < plan->count; k++)
+	{
+		if (plan->stage[k].type == STAGE_BRIGHTNESS && plan->stage[k].param[1] != EXPOSURE_MANUAL) mode = plan->stage[k].param[1];
+	}
+	if (mode != exposure.mode)  // restart exposure control
+	{
+		memset(&exposure,0,sizeof(exposure));
+		exposure.mode = mode;
+	}
+
+	scheduler->enabled = (1<<STAGE_OUTPUT);  // stages that cost time with these settings
+	for (int k=0; k < plan->count; k++)
+	{
+		scheduler->enabled |= (1<<plan->stage[k].type);
+	}
+}
+
+// inverse of the geometric stages of the plan for the chroma: source of every chroma pixel in chroma_map
+// (the luma pixel (2x,2y) is traced back through the stages as execute_plan() computes it)
+static void plan_chroma(const pipeline_t *plan)
+{
+	const stage_t *st;
+	int size[MAX_STAGES+1][2];  // view size before stage i
+	int i, x, y, sx, sy, moved = 0;
+	remap_coord c;
+
+	size[0][0] = W;
+	size[0][1] = H;
+	for (i=0; i < plan->count; i++)
+	{
+		geometry_size(plan->stage[i].type,plan->stage[i].param[0],size[i],size[i+1]);
+		moved |= stage_types[plan->stage[i].type].kind == KIND_VIEW || stage_types[plan->stage[i].type].kind == KIND_GEOMETRY;
+		if (plan->stage[i].type == STAGE_REMAP) remap_prepare(&plan->stage[i]);
+	}
+	chroma_moved = moved;
+	if (!moved) return;
+
+	for (y=0; y < H/2; y++)
+	{
+		for (x=0; x < W/2; x++)
+		{
+			sx = 2*x < size[plan->count][0] && 2*y < size[plan->count][1] ? 2*x : -1;  // outside of the view: 0
+			sy = 2*y;
+			for (i=plan->count-1; i >= 0 && sx >= 0; i--)
+			{
+				st = &plan->stage[i];
+				if (st->type == STAGE_REMAP)  // nearest source pixel
+				{
+					c = remap_table[remap_index(sx,sy)];
+					sx = c.x == REMAP_NONE ? -1 : (c.x + (1<<REMAP_FRAC>>1)) >> REMAP_FRAC;
+					sy = (c.y + (1<<REMAP_FRAC>>1)) >> REMAP_FRAC;
+				}
+				if (!geometry_source(st->type,st->param[0],size[i][0],size[i][1],&sx,&sy)) sx = -1;  // no source, set to 0 by the stage
+			}
+			chroma_map[y*(W/2)+x] = sx < 0 ? -1 : (sy>>1)*(W/2) + (sx>>1);
+		}
+	}
+}
+
+// read the settings again when the file changed
+static void update_settings(pipeline_t *pipeline, pipeline_t *plan, frame_scheduler *scheduler, time_t *last_time)
+{
+	struct stat fileInfo;
+	double t;
+
+	stat(SETTINGS_FILENAME,&fileInfo);
+	
+	if (fileInfo.st_mtime!=*last_time) 
+	{
+		t = trace_begin();
+		read_settings(SETTINGS_FILENAME,pipeline);
+		apply_settings(pipeline,plan,scheduler);
+		if (INPUT_CHROMA != CHROMA_GRAY)
+		{
+			plan_chroma(plan);
+		}
+		print_pipeline(log_file,"Einstellungen",pipeline);
+		print_pipeline(log_file,"Plan",plan);
+		*last_time=fileInfo.st_mtime;
+		trace_end("settings",t);
+	}
+}
+
+// process the frames of the input from the current position on, frame numbers start with "warmup",
+// frames before "first" are processed without output, stops before frame "last" (-1: at the end of the input)
+long process_frames(FILE *in_file, long warmup, long first, long last)
+{
+	long i = warmup;         // number of the frame
+	pipeline_t pipeline;     // stages as described in the settings
+	pipeline_t plan;         // equivalent stages that are executed
+	img_view view;           // final image of the processing chain
+	frame_scheduler scheduler;                  // measured stage costs and quality level
+	int incremental = 0;                        // filters may recompute only the changed tiles
+	int got_frame;                              // result of next_frame()
+	unsigned long frame_id = 0;                 // id of the input content for the stage cache
+	double t;                                   // time stamp in msec
+	double t_trace;                             // begin of the frame in the trace
+	stage_probe probe;                          // performance counters and trace of the output
+#ifdef DEADLINE_SCHEDULER
+	double t_frame, t_read;                     // start of the frame, end of the last frame
+	int planned = 0;                            // the quality level of the frame is chosen
+#endif
+#ifdef SLICE_STREAMING
+	int streaming = 0;                          // the plan is known before the frame arrives
+#endif
+#ifdef JITTER_HISTOGRAM
+	jitter_stats jitter;                        // intervals between the written frames
+#endif
+#ifdef INCREMENTAL_PROCESSING
+	int changed_tiles = -1;                     // number of changed tiles in the log
+#endif
+	time_t last_time=0;
+
+	memset(&scheduler,0,sizeof(scheduler));
+#ifdef JITTER_HISTOGRAM
+	memset(&jitter,0,sizeof(jitter));
+#endif
+	counters_open();
+	
+#ifdef DEADLINE_SCHEDULER
+		t_read = now_ms();
+#endif
+		while((last < 0 || i < last) && !stop_requested)
+		{
+			if (trace_dump_requested)  // SIGUSR1
+			{
+				trace_dump_requested = 0;
+				trace_dump();
+			}
+			trace_frame = i;
+			t_trace = trace_begin();
+#ifdef SLICE_STREAMING
+  #ifdef DEADLINE_SCHEDULER
+			if ((planned = streaming))
+			{
+				scheduler_plan(&scheduler,i);  // before the frame arrives
+			}
+  #endif
+			if (streaming && can_stream(&plan,&scheduler))  // read, process and write the frame in slices
+			{
+				start_count();
+  #ifdef DEADLINE_SCHEDULER
+				t_frame = now_ms();
+  #endif
+				if (!stream_frame(&plan,&scheduler,in_file,i >= first)) break;
+				trace_end("frame",t_trace);
+				stop_count();
+				fprintf(log_file,"%f msec for streaming image %ld\n", get_time_ms(),i);
+  #ifdef JITTER_HISTOGRAM
+				jitter_add(&jitter,now_ms());
+  #endif
+  #ifdef DEADLINE_SCHEDULER
+				scheduler_finish(&scheduler,i,now_ms()-t_frame);
+				t_read = now_ms();
+  #endif
+				frame_id++;         // the stage results are not those of the cache keys
+				changes.valid = 0;  // nor of the reference of the change detection
+				update_settings(&pipeline,&plan,&scheduler,&last_time);
+				i++;
+				continue;
+			}
+#endif
+			if (!(got_frame = next_frame(inp,in_file,i-warmup,last_time))) // loop until no more input data is available
+			{
+				break;
+			}
+			trace_end("read",t_trace);
+			start_count(); // start time measurement
+#ifdef DEADLINE_SCHEDULER
+			t_frame = now_ms();
+#endif
+			
+			update_settings(&pipeline,&plan,&scheduler,&last_time);
+			
+#ifdef DEADLINE_SCHEDULER
+			if (!planned)
+			{
+				scheduler_plan(&scheduler,i);
+			}
+			if(scheduler.q.drop && t_frame-t_read < SCHED_QUEUED_MS)  // next frame is already waiting in the pipe: drop this one
+			{
+				fprintf(log_file,"Bild %ld verworfen\n",i);
+				i++;
+				t_read = now_ms();
+				continue;
+			}
+#endif
+
+#ifdef INCREMENTAL_PROCESSING
+			incremental = changes.valid;
+			if(detect_changes(&changes,inp) > 0)
+			{
+				frame_id++;
+			}
+			if (changes.count != changed_tiles)  // only when the number changes
+			{
+				changed_tiles = changes.count;
+				fprintf(log_file,"%d von %d Kacheln geaendert\n",changed_tiles,TILES_X*TILES_Y);
+			}
+#else
+			if(got_frame == 1)
+			{
+				frame_id++;
+			}
+#endif
+			
+			#ifdef REALTIME_PROCESSING_SIMULATION  	
+			fprintf(log_file,"realtime estimation : process image %d times (this might take a while ...)\n", realtime_factor);
+			for (int j=0;j<realtime_factor;j++) // repeat execution for simulating realtime requirements  
+			#endif 	
+			{	
+				//execute image processing
+				//stages with the same key and input as in the last frame keep their result
+				view = execute_plan(&plan,&scheduler,inp,frame_id,incremental);
+			}
+		
+			stop_count(); // stop time measurement
+			fprintf(log_file,"%f msec for processing image %ld\n", get_time_ms(),i);
+			t = now_ms();
+			if (i >= first)
+			{
+				probe_begin(&probe);
+				write_outputs(view);  
+				probe_end(STAGE_OUTPUT,&probe,W*H);
+			}
+			t = scheduler_measure(&scheduler,STAGE_OUTPUT,0,t);
+			trace_end("frame",t_trace);
+#ifdef JITTER_HISTOGRAM
+			jitter_add(&jitter,t);
+#endif
+#ifdef DEADLINE_SCHEDULER
+			scheduler_finish(&scheduler,i,t-t_frame);
+			t_read = now_ms();
+#endif
+#ifdef SLICE_STREAMING
+			streaming = 1;
+#endif
+			i++;
+		}
+#ifdef JITTER_HISTOGRAM
+	jitter_report(log_file,&jitter);
+#endif
+	counters_report(log_file);
+	return i - (first > warmup ? first : warmup);  // frames written
+}
+
+#ifdef MULTI_STREAM
+static void *stream_thread(void *arg)  // reads, processes and writes stream k
+{
+	int k = (int)(intptr_t)arg;
+	FILE *in_file;
+	long frames;
+
+	SETTINGS_FILENAME = streams[k].settings;
+	outputs[0].name = streams[k].output;
+	own_queue = &band_queues[k];
+#ifdef _OPENMP
+	omp_set_num_threads(1);  // the cores are shared by the pool
+#endif
+	in_file = open_file(streams[k].input,"rb");
+	open_outputs();
+	frames = process_frames(in_file,0,0,-1);
+	fclose(in_file);
+	close_outputs();
+	fprintf(log_file,"stream %d (%s): %ld frames\n",k,streams[k].input,frames);
+	return (void *)(intptr_t)frames;
+}
+
+long run_streams()  // returns the frames written by all streams
+{
+	pthread_t thread[STREAMS];
+	void *frames;
+	long sum = 0;
+	int k;
+
+	start_pool();
+	for (k=0; k < STREAMS; k++)
+	{
+		if (pthread_create(&thread[k],NULL,stream_thread,(void *)(intptr_t)k) != 0)
+		{
+			fprintf(log_file,"Error starting stream threads ==> exit.\n");
+			exit(-1);
+		}
+	}
+	for (k=0; k < STREAMS; k++)
 	{
-		for (x=0; x < W; x++)  // loop over all rows
+		pthread_join(thread[k],&frames);
+		sum += (long)(intptr_t)frames;
+	}
+	return sum;
+}
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// library interface (img_proc.h)
+// a pipeline has its own settings, plan, stage costs and exposure control, the buffers and the stage cache
+// are shared; when the last frame was processed by another pipeline, the settings are applied again
+// (kernel files) and the change detection starts anew
+///////////////////////////////////////////////////////////////////////////////
+
+struct img_pipeline
+{
+	char *settings;             // text in the format of the settings file
+	pipeline_t stages, plan;
+	frame_scheduler scheduler;  // measured costs of the stages (no quality reductions)
+	exposure_ctrl exposure;     // state while another pipeline is active
+	double frame_ms;            // average time of a frame
+};
+
+static img_pipeline *active_pipeline = NULL;  // pipeline of the last frame
+static unsigned long pipeline_frame_id = 0;   // id of the input content for the stage cache (all pipelines)
+
+static void load_pipeline(img_pipeline *p)  // read and plan the settings
+{
+	FILE *f;
+
+	p->stages.count = 0;
+	if (p->settings[0] && (f = fmemopen(p->settings,strlen(p->settings),"r")) != NULL)
+	{
+		read_settings_file(f,&p->stages);
+		fclose(f);
+	}
+	apply_settings(&p->stages,&p->plan,&p->scheduler);
+}
+
+img_pipeline *img_pipeline_create(const char *settings)
+{
+	img_pipeline *p = calloc(1,sizeof(img_pipeline));
+
+	if (log_file == NULL)
+	{
+		log_file = stderr;
+	}
+	if (p == NULL || (p->settings = strdup(settings ? settings : "")) == NULL)
+	{
+		free(p);
+		return NULL;
+	}
+	p->exposure.mode = EXPOSURE_MANUAL;
+	return p;
+}
+
+int img_pipeline_set(img_pipeline *p, const char *settings)
+{
+	char *text = strdup(settings ? settings : "");
+
+	if (text == NULL)
+	{
+		return -1;
+	}
+	free(p->settings);
+	p->settings = text;
+	if (active_pipeline == p)
+	{
+		load_pipeline(p);
+	}
+	return 0;
+}
+
+int img_pipeline_process(img_pipeline *p, const void *in, void *out)
+{
+	pixel (*img)[W] = (pixel (*)[W])in;  // the stages only read their input
+	img_view view;
+	int incremental = 0;
+	double t0 = now_ms(), t;
+
+	if (active_pipeline != p)
+	{
+		if (active_pipeline != NULL) active_pipeline->exposure = exposure;
+		exposure = p->exposure;
+		active_pipeline = p;
+		load_pipeline(p);
+		changes.valid = 0;
+	}
+#ifdef INCREMENTAL_PROCESSING
+	incremental = changes.valid;
+	if (detect_changes(&changes,img) > 0)
+	{
+		pipeline_frame_id++;
+	}
+#else
+	pipeline_frame_id++;
+#endif
+	view = execute_plan(&p->plan,&p->scheduler,img,pipeline_frame_id,incremental);
+
+	t = now_ms();
+	if (out == in && view.base >= &img[0][0] && view.base < &img[0][0] + W*H)  // the result is a view of the input
+	{
+		view = materialize(view);
+	}
+	view_to_image((pixel (*)[W])out,view);
+	t = scheduler_measure(&p->scheduler,STAGE_OUTPUT,0,t);
+	p->frame_ms = (p->frame_ms == 0) ? t-t0 : p->frame_ms + SCHED_AVERAGE*((t-t0) - p->frame_ms);
+	return 0;
+}
+
+int img_pipeline_timings(const img_pipeline *p, img_timing *timings, int max)
+{
+	int stage, n = 0;
+
+	for (stage=0; stage < STAGES; stage++)
+	{
+		if (!(p->scheduler.enabled & (1<<stage)) || p->scheduler.cost[0][stage] == 0) continue;
+		if (n < max)
 		{
-			out[y][x] = in[y][x];  // process each pixel
+			timings[n].stage = stage_types[stage].name;
+			timings[n].ms = p->scheduler.cost[0][stage];
 		}
-		
+		n++;
+	}
+	if (n < max)
+	{
+		timings[n].stage = "frame";
+		timings[n].ms = p->frame_ms;
+	}
+	return n+1;
+}
+
+void img_pipeline_size(int *width, int *height)
+{
+	*width = W;
+	*height = H;
+}
+
+int img_pipeline_bits(void)
+{
+	return PIXEL_BITS;
+}
+
+void img_pipeline_destroy(img_pipeline *p)
+{
+	if (p == NULL)
+	{
+		return;
+	}
+	if (active_pipeline == p)
+	{
+		active_pipeline = NULL;
+	}
+	free(p->settings);
+	free(p);
+}
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+
+#ifdef FILE_IO
+static void start_process(int jobs)  // settings of a new process of a pool
+{
+	setvbuf(log_file,NULL,_IOLBF,0);  // whole lines of the processes in the log
+	trace_start(1);
+#ifdef _OPENMP
+	omp_set_num_threads(omp_get_num_procs() > jobs ? omp_get_num_procs()/jobs : 1);  // its share of the cores
+#else
+	(void)jobs;
+#endif
+}
+
+// split the frames first <= i < last into ranges for the processes, the outputs of a process
+// go to parts that are appended to the outputs at the end
+void run_jobs(long first, long last, int jobs)
+{
+	long from, to;
+	pid_t pid;
+	int k, i, status, failed = 0;
+	FILE *in_file;
+
+	fflush(NULL);  // nothing buffered twice
+	for (k=0; k < jobs; k++)
+	{
+		from = first + (last-first)*k/jobs;
+		to   = first + (last-first)*(k+1)/jobs;
+		pid = fork();
+		if (pid < 0)
+		{
+			fprintf(log_file,"Error starting process ==> exit.\n");
+			exit(-1);
+		}
+		if (pid == 0)  // process for the frames from <= i < to
+		{
+			start_process(jobs);
+			for (i=0; i < OUTPUTS; i++)
+			{
+				outputs[i].part = part_name(i,k);
+			}
+			in_file = open_file(INPUT_FILENAME, "rb");  // own file position, the frame index is inherited
+			from = from > first + FRAME_WARMUP ? from - FRAME_WARMUP : first;
+			if (!seek_frame(in_file,from)) exit(-1);
+			open_outputs();
+			process_frames(in_file,from,first + (last-first)*k/jobs,to);
+			close_outputs();
+			exit(0);
+		}
+	}
+	for (k=0; k < jobs; k++)
+	{
+		if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) failed = 1;
+	}
+	if (failed)
+	{
+		fprintf(log_file,"a process failed, the parts of the outputs are kept ==> exit.\n");
+		exit(-1);
+	}
+	open_outputs();
+	join_parts(jobs);
+	close_outputs();
+}
+
+// number of processes for a number of tasks (jobs = 0: JOBS)
+int number_of_jobs(int jobs, long tasks)
+{
+	long n = jobs > 0 ? jobs : JOBS > 0 ? JOBS : sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (n > tasks)
+	{
+		n = tasks;
+	}
+	return n > 1 ? n : 1;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// batch processing
+// every file is processed by its own process (fresh state: caches, exposure control), at most "jobs" at a time;
+// the processes report their number of frames through a pipe
+///////////////////////////////////////////////////////////////////////////////
+
+typedef struct
+{
+	char **name;
+	int count;
+} file_list;
+
+static void add_file(file_list *l, const char *dir, const char *name)  // dir/name (name "": dir only)
+{
+	char *path = malloc(strlen(dir) + strlen(name) + 2);
+
+	if ((l->count & (l->count-1)) == 0)  // grows to the next power of 2
+	{
+		l->name = realloc(l->name,(l->count ? 2 * l->count : 1)*sizeof(char *));
+	}
+	if (path == NULL || l->name == NULL)
+	{
+		fprintf(log_file,"Error allocating memory ==> exit.\n");
+		exit(-1);
+	}
+	sprintf(path,*name ? "%s/%s" : "%s%s",dir,name);
+	l->name[l->count++] = path;
+}
+
+static int is_image_file(const char *name)
+{
+	return has_suffix(name,".raw") || has_suffix(name,".pgm") || has_suffix(name,".y4m") || has_suffix(name,".ipc");
+}
+
+// add the files of a command line argument: directory, pattern or @list
+void add_batch_input(file_list *l, char *arg)
+{
+	struct stat info;
+	struct dirent *entry;
+	DIR *dir;
+	FILE *list;
+	glob_t g;
+	char *line = NULL;
+	size_t size = 0, i;
+	ssize_t n;
+
+	if (arg[0] == '@')  // one name per line
+	{
+		list = open_file(arg+1, "r");
+		while ((n = getline(&line,&size,list)) >= 0)
+		{
+			while (n > 0 && isspace((unsigned char)line[n-1])) line[--n] = 0;
+			if (n > 0 && line[0] != '#') add_file(l,line,"");
+		}
+		free(line);
+		fclose(list);
+	}
+	else if (stat(arg,&info) == 0 && S_ISDIR(info.st_mode))
+	{
+		if ((dir = opendir(arg)) == NULL)
+		{
+			fprintf(log_file,"Error opening directory %s ==> exit.\n",arg);
+			exit(-1);
+		}
+		while ((entry = readdir(dir)) != NULL)
+		{
+			if (is_image_file(entry->d_name)) add_file(l,arg,entry->d_name);
+		}
+		closedir(dir);
+	}
+	else if (glob(arg,0,NULL,&g) == 0)  // also a single file
+	{
+		for (i=0; i < g.gl_pathc; i++) add_file(l,g.gl_pathv[i],"");
+		globfree(&g);
+	}
+	else
+	{
+		fprintf(log_file,"no files for %s\n",arg);
+	}
+}
+
+static int compare_names(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a,*(char * const *)b);
+}
+
+// process one file in the current process, returns the number of frames
+static long process_file(char *filename, const char *out_dir)
+{
+	const char *base = strrchr(filename,'/') ? strrchr(filename,'/') + 1 : filename;
+	const char *sink;
+	int i, length = strrchr(base,'.') ? strrchr(base,'.') - base : (int)strlen(base);  // without extension
+	FILE *in_file;
+	long frames;
+
+	for (i=0; i < OUTPUTS; i++)  // dir/<file name>.<output file name>
+	{
+		sink = strcmp(outputs[i].name,"-") == 0 ? "stdout.raw" : strrchr(outputs[i].name,'/') ? strrchr(outputs[i].name,'/') + 1 : outputs[i].name;
+		outputs[i].name = malloc(strlen(out_dir) + length + strlen(sink) + 3);
+		if (outputs[i].name == NULL)
+		{
+			fprintf(log_file,"Error allocating memory ==> exit.\n");
+			exit(-1);
+		}
+		sprintf(outputs[i].name,"%s/%.*s.%s",out_dir,length,base,sink);
 	}
+	in_file = open_input(filename);
+	open_outputs();
+	frames = process_frames(in_file,0,0,input.frames);
+	fclose(in_file);
+	close_outputs();
+	fprintf(log_file,"%s: %ld frames\n",filename,frames);
+	return frames;
 }
 
+// process the files of a shard in a pool of processes, returns the number of frames
+long run_batch(file_list *l, const char *out_dir, int shard, int shards, int jobs)
+{
+	pid_t pid, *pids;
+	int fd[2], k, j, files = 0, running = 0, failed = 0, status;
+	long frames = 0, n;
+
+	qsort(l->name,l->count,sizeof(char *),compare_names);  // the same order on every machine
+	for (k=0, j=0; k < l->count; k++)
+	{
+		if (j == 0 || strcmp(l->name[k],l->name[j-1]) != 0) l->name[j++] = l->name[k];  // named twice
+	}
+	l->count = j;
+	for (k=shard; k < l->count; k+=shards) files++;
+	jobs = number_of_jobs(jobs,files);
+	fprintf(log_file,"%d of %d files (shard %d/%d) in %d processes\n",files,l->count,shard,shards,jobs);
 
-uint8_t inp[H][W], out[H][W], temp1[H][W], temp2[H][W], temp3[H][W], temp4[H][W], temp5[H][W];  // define arrays for input and output image
+	mkdir(out_dir,0777);  // if it does not exist
+	pids = calloc(l->count+1,sizeof(pid_t));
+	if (pids == NULL || pipe(fd) != 0)
+	{
+		fprintf(log_file,"Error starting processes ==> exit.\n");
+		exit(-1);
+	}
+	for (k=shard; k < l->count || running > 0; )
+	{
+		if (k < l->count && running < jobs && !stop_requested)  // start the next file
+		{
+			fflush(NULL);  // nothing buffered twice
+			pid = fork();
+			if (pid < 0)
+			{
+				fprintf(log_file,"Error starting process ==> exit.\n");
+				exit(-1);
+			}
+			if (pid == 0)
+			{
+				close(fd[0]);
+				start_process(jobs);
+				n = process_file(l->name[k],out_dir);
+				exit(write(fd[1],&n,sizeof(n)) == sizeof(n) ? 0 : -1);
+			}
+			pids[k] = pid;
+			running++;
+			k += shards;
+			continue;
+		}
+		if ((pid = wait(&status)) < 0)
+		{
+			break;
+		}
+		running--;
+		if (WIFEXITED(status) && WEXITSTATUS(status) == 0 && read(fd[0],&n,sizeof(n)) == sizeof(n))
+		{
+			frames += n;
+			continue;
+		}
+		for (j=0; j < l->count && pids[j] != pid; j++);
+		fprintf(log_file,"%s failed\n",j < l->count ? l->name[j] : "a file");
+		failed++;
+	}
+	close(fd[0]);
+	close(fd[1]);
+	free(pids);
+	fprintf(log_file,"%d files processed, %d failed\n",files-failed,failed);
+	return frames;
+}
+#endif
 
 
-int main () 
+#ifndef IMG_PROC_LIBRARY  // see img_proc.h
+int main (int argc, char *argv[]) 
 {	
-	int i=0;
-	FILE *in_file,*out_file;
+#ifndef MULTI_STREAM
+	FILE *in_file;
+	long first = 0, last = -1;  // range of frames
+	long warmup;                // first frame that is processed
+#endif
+	long frames;                // frames written
+#ifdef FILE_IO
+	int jobs = 0;               // processes (0: JOBS)
+	int batch = 0, shard = 0, shards = 1;
+	char *out_dir = BATCH_OUTPUT_DIR;
+	file_list files = { NULL, 0 };
+	int a, numbers = 0;
+	long count = -1;
+#endif
+	double t = now_ms();
 	 
 #ifdef FILE_IO	
 	log_file = stdout;                             // write log messages to stdout
-	in_file  = open_file(INPUT_FILENAME, "rb");     // open input file (raw image data = pgm file without header)
-	out_file = open_file(OUTPUT_FILENAME, "wb");    // open/create output file (pgm file)
-	write_pgm_header(out_file);                    // write PGM header (for grayscale: P5, dimensions and max pixel value)
+	for (a=1; a < argc; a++)  // command line, see JOBS
+	{
+		if (strcmp(argv[a],"--batch") == 0) batch = 1;
+		else if (strcmp(argv[a],"--out") == 0 && a+1 < argc) out_dir = argv[++a];
+		else if (strcmp(argv[a],"--shard") == 0 && a+1 < argc && sscanf(argv[++a],"%d/%d",&shard,&shards) == 2 && shard >= 0 && shard < shards);
+		else if (strcmp(argv[a],"--jobs") == 0 && a+1 < argc && (jobs = atoi(argv[++a])) > 0);
+		else if (strncmp(argv[a],"--",2) != 0 && batch) add_batch_input(&files,argv[a]);
+		else if (strncmp(argv[a],"--",2) != 0 && numbers == 0) { first = atol(argv[a]); numbers++; }
+		else if (strncmp(argv[a],"--",2) != 0 && numbers == 1) { count = atol(argv[a]); numbers++; }
+		else
+		{
+			fprintf(stderr,"usage: img_proc [first frame [number of frames]] [--jobs n]\n"
+			               "       img_proc --batch [--out dir] [--shard i/N] [--jobs n] directory|pattern|@list ...\n");
+			exit(-1);
+		}
+	}
+	if (!batch)
+	{
+		in_file = open_input(INPUT_FILENAME);      // open input file (raw image data = pgm file without header, .pgm, .y4m or .ipc)
+		last = count >= 0 ? first + count : -1;    // part of the input
+  #ifndef STILL_IMAGE_TUNING
+		if (input.frames >= 0 && (last < 0 || last > input.frames)) last = input.frames;
+		if (first > 0 && !seek_frame(in_file,first))
+		{
+			fprintf(log_file,"input has no frame %ld ==> exit.\n",first);
+			exit(-1);
+		}
+		jobs = number_of_jobs(jobs,(last - first) / JOB_MIN_FRAMES);
+  #else
+		jobs = 1;
+  #endif
+	}
 #else
+	(void)argc;                                    // live video has no command line
+	(void)argv;
 	log_file = open_file("performance.log", "w");  // open log file for writing status messages
+  #ifndef MULTI_STREAM
 	in_file  = stdin;                              // read raw grayscale video from stdin
-	out_file = stdout;                             // write raw grayscale video to stdout 
+  #endif
 #endif	 
-	 
-	size_t size=0;
-	char *buffer=NULL; 
-	int paramFir=0, paramMedian=0, paramZoom=0, paramBrightness=0, paramFlip=0, paramRotation=0;
-    FILE *settings_file;
-	struct stat fileInfo;
-	time_t last_time=0;
-
 
+#ifdef REALTIME_MODE
+	realtime_setup();
+#endif
+	trace_start(0);
 	fprintf(log_file,"process images\n");	
-	
-		
-		while(read_image(inp,in_file)) // loop until no more input data is available
-		{
-			start_count(); // start time measurement
-			
-			stat(SETTINGS_FILENAME,&fileInfo);
-			
-			if (fileInfo.st_mtime!=last_time) 
-			{
-				settings_file = open_file(SETTINGS_FILENAME, "r");  // open settings file 
-				getline(&buffer,&size,settings_file);               // read from settings file
-				sscanf(buffer, "%d", &paramFir);                    // convert the line to an integer value of the parameter
-				getline(&buffer,&size,settings_file);               // read from settings file
-				sscanf(buffer, "%d", &paramMedian);                 // convert the line to an integer value of the parameter
-				getline(&buffer,&size,settings_file);               // read from settings file
-				sscanf(buffer, "%d", &paramZoom);                   // convert the line to an integer value of the parameter
-				getline(&buffer,&size,settings_file);               // read from settings file
-				sscanf(buffer, "%d", &paramBrightness);             // convert the line to an integer value of the parameter
-				getline(&buffer,&size,settings_file);               // read from settings file
-				sscanf(buffer, "%d", &paramFlip);                   // convert the line to an integer value of the parameter
-				getline(&buffer,&size,settings_file);               // read from settings file
-				sscanf(buffer, "%d", &paramRotation);               // convert the line to an integer value of the parameter
-				fclose(settings_file); 
-			
-			
-				//print out the parameter   
-				if(paramFir!=1)
-				{
-					fprintf(log_file,"FIR Filter: nein\n");
-				}
-				else
-				{
-					fprintf(log_file,"FIR Filter: ja\n");
-				}
-			
-				if(paramMedian!=1)
-				{
-					fprintf(log_file,"Median Filter: nein\n");
-				}
-				else
-				{
-					fprintf(log_file,"Median Filter: ja\n");
-				}
-			
-				fprintf(log_file,"Zoom Faktor ist: %d\n",paramZoom);
-				fprintf(log_file,"Helligkeitaederung Parameter ist: %d\n",paramBrightness);
-			
-				if(paramFlip!=1)
-				{
-					fprintf(log_file,"Um vertikale Achse spiegeln: nein\n");
-				}
-				else
-				{
-					fprintf(log_file,"Um vertikale Achse spiegeln: ja\n");
-				}
-			
-				fprintf(log_file,"Rotation um %d Grad\n",paramRotation);
-			
-			
-
-				last_time=fileInfo.st_mtime;
-			}
-			
-			#ifdef REALTIME_PROCESSING_SIMULATION  	
-			fprintf(log_file,"realtime estimation : process image %d times (this might take a while ...)\n", realtime_factor);
-			for (int j=0;j<realtime_factor;j++) // repeat execution for simulating realtime requirements  
-			#endif 	
-			{	
-				//execute image processing
-				
-				
-				if(paramFir!=1)
-				{
-					array_copy(temp1,inp);
-				}
-				else
-				{
-					fir_filter(temp1,inp);
-				}
-			
-				if(paramMedian!=1)
-				{
-					array_copy(temp2,temp1);
-				}
-				else
-				{
-					median_filter(temp2,temp1);
-				}
-				
-				if(paramZoom==0)
-				{
-					array_copy(temp3,temp2);
-				}
-				else
-				{
-					zoom(temp3,temp2,paramZoom);
-				}
-				
-				change_brightness(temp4,temp3,paramBrightness);
-			
-				if(paramFlip!=1)
-				{
-					array_copy(temp5,temp4);
-				}
-				else
-				{
-					flip_horizontal(temp5,temp4);
-				}
-				
-				rotation(out,temp5,paramRotation);
-				
-							
-			}
-		
-			stop_count(); // stop time measurement
-			fprintf(log_file,"%f msec for processing image %d\n", get_time_ms(),i);
-			write_image(out,out_file);  
-			i++;
-		}
-		fprintf(log_file,"done\n");
-
-		// close files
+#ifdef MULTI_STREAM
+	frames = run_streams();
+#else
+  #ifdef FILE_IO
+	if (batch)
+	{
+		frames = run_batch(&files,out_dir,shard,shards,jobs);
+	}
+	else if (jobs > 1)
+	{
+		fprintf(log_file,"frames %ld to %ld in %d processes\n",first,last-1,jobs);
+		fclose(in_file);
+		run_jobs(first,last,jobs);
+		frames = last - first;
+	}
+	else
+  #endif
+	{
+		warmup = first > FRAME_WARMUP ? first - FRAME_WARMUP : 0;
+		if (warmup < first) seek_frame(in_file,warmup);
+		open_outputs();                            // open/create output files (pgm file: with header) or stdout
+		frames = process_frames(in_file,warmup,first,last);
 		fclose(in_file);    
-		fclose(out_file);  
-		fclose(log_file);  
+		close_outputs();  
+	}
+#endif
+	if (frames > 0)
+	{
+		t = now_ms() - t;
+		fprintf(log_file,"%ld frames in %.1f sec, %.1f frames/sec, %.1f Mpixel/sec\n",frames,t/1000,frames*1000/t,frames*(W*H/1000.0)/t);
+	}
+	fprintf(log_file,"done\n");
+	fclose(log_file);  
 	
-		sleep(1);  
-		free(buffer);
+	sleep(1);  
 	return 0;
 }
-
-
+#endif
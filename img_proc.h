@@ -0,0 +1,96 @@
+#ifndef IMG_PROC_H
+#define IMG_PROC_H
+
+// in-process interface of the processing in img_proc.c, the capture software hands its frames over by pointer
+// library build: gcc -std=c99 -O2 -DIMG_PROC_LIBRARY -c img_proc.c (with -fopenmp as the program)
+// frames are grayscale, W x H pixels without gaps between the lines (see img_pipeline_size()), one byte per pixel
+// or with more than 8 bit (img_pipeline_bits(), PIXEL_BITS) one uint16_t per pixel;
+// the buffers of the processing are shared by all pipelines, call the functions from one thread at a time;
+// there is one history for a "temporal" stage, it restarts when another pipeline with such a stage ran in between
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct img_pipeline img_pipeline;
+
+typedef struct
+{
+	const char *stage;  // name as in the settings, "frame" for the whole frame
+	double ms;          // average time in msec
+} img_timing;
+
+// settings: text in the format of the settings file (one stage per line, e.g. "median\nbrightness offset=20\n"),
+// NULL or "" copies the frames; returns NULL without memory
+img_pipeline *img_pipeline_create(const char *settings);
+
+// replace the settings, returns 0 (-1 without memory, the old settings stay)
+int img_pipeline_set(img_pipeline *p, const char *settings);
+
+// process the frame in into out (out == in: in place), returns 0
+int img_pipeline_process(img_pipeline *p, const void *in, void *out);
+
+// average times of the stages of the current settings and of the frame, returns the number of entries
+// (only the first max are written)
+int img_pipeline_timings(const img_pipeline *p, img_timing *timings, int max);
+
+void img_pipeline_size(int *width, int *height);
+
+int img_pipeline_bits(void);  // bits per pixel of the frames (8: uint8_t, more: uint16_t)
+
+void img_pipeline_destroy(img_pipeline *p);
+
+#ifdef __cplusplus
+}
+
+#include <new>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace img_proc
+{
+	// owns an img_pipeline
+	class Pipeline
+	{
+	public:
+		explicit Pipeline(const std::string &settings = "") : p(img_pipeline_create(settings.c_str()))
+		{
+			if (p == nullptr) throw std::bad_alloc();
+		}
+		~Pipeline() { img_pipeline_destroy(p); }
+
+		Pipeline(const Pipeline &) = delete;
+		Pipeline &operator=(const Pipeline &) = delete;
+		Pipeline(Pipeline &&o) noexcept : p(o.p) { o.p = nullptr; }
+		Pipeline &operator=(Pipeline &&o) noexcept { std::swap(p,o.p); return *this; }
+
+		void set(const std::string &settings)
+		{
+			if (img_pipeline_set(p,settings.c_str()) != 0) throw std::bad_alloc();
+		}
+		void process(const void *in, void *out) { img_pipeline_process(p,in,out); }
+		void process(void *frame) { img_pipeline_process(p,frame,frame); }
+
+		std::vector<img_timing> timings() const
+		{
+			std::vector<img_timing> t(img_pipeline_timings(p,nullptr,0));
+			img_pipeline_timings(p,t.data(),(int)t.size());
+			return t;
+		}
+
+		static int width() { int w, h; img_pipeline_size(&w,&h); return w; }
+		static int height() { int w, h; img_pipeline_size(&w,&h); return h; }
+		static int bits() { return img_pipeline_bits(); }
+
+		img_pipeline *get() const { return p; }
+
+	private:
+		img_pipeline *p;
+	};
+}
+#endif
+
+#endif
@@ -72,6 +72,7 @@ int main ()
   size_t size_paramBrightness=0;
   size_t size_paramFlip=0;
   size_t size_paramRotation=0;
+  size_t size_paramExposure=0;
   
   
   char *buffer_paramFir = NULL; 
@@ -80,6 +81,7 @@ int main ()
   char *buffer_paramBrightness = NULL; 
   char *buffer_paramFlip = NULL; 
   char *buffer_paramRotation = NULL; 
+  char *buffer_paramExposure = NULL; 
   
   FILE *settings_file;
 
@@ -97,10 +99,12 @@ int main ()
     getline(&buffer_paramZoom,&size_paramZoom,stdin);     // read input from console
     printf("\nGeben Sie den Parameter fuer die Helligkeitaenderung an (Zahl): ");
     getline(&buffer_paramBrightness,&size_paramBrightness,stdin);     // read input from console
-    printf("\nMoechten Sie das Bild um den vertikale Achse spiegeln (Ja:1; Nein:0): ");
+    printf("\nMoechten Sie das Bild spiegeln (Nein:0; vertikale Achse:1; horizontale Achse:2; beide:3): ");
     getline(&buffer_paramFlip,&size_paramFlip,stdin);     // read input from console
     printf("\nUm wie viel Grad moechten Sie das Bild drehen (Zahl): ");
     getline(&buffer_paramRotation,&size_paramRotation,stdin);     // read input from console
+    printf("\nBelichtungsautomatik (Aus:0; Helligkeit:1; Kontrast:2; Histogrammausgleich:3): ");
+    getline(&buffer_paramExposure,&size_paramExposure,stdin);     // read input from console
 
     printf("Schreibe Parameter in Settings-Datei ... ");
     settings_file = open_file(SETTINGS_FILENAME, "w");  // open text file for storing settings
@@ -110,6 +114,7 @@ int main ()
     fputs(buffer_paramBrightness, settings_file);                // write Parameter
     fputs(buffer_paramFlip, settings_file);                // write Parameter
     fputs(buffer_paramRotation, settings_file);                // write Parameter
+    fputs(buffer_paramExposure, settings_file);                // write Parameter
     
     fclose(settings_file);        
     printf("fertig\n");
@@ -123,5 +128,6 @@ int main ()
   free(buffer_paramBrightness);
   free(buffer_paramFlip);
   free(buffer_paramRotation);
+  free(buffer_paramExposure);
   return 0;
 }